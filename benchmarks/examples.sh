@@ -0,0 +1,23 @@
+#!/bin/sh
+# Compare the example programs compiled with and without whole program optimization: the size of
+# the IR rpn prints, the size of the executable clang makes from it, and how long that takes to run.
+#
+#   benchmarks/examples.sh [path to rpn]
+
+rpn=${1:-./rpn}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf "%-16s %-8s %10s %10s %8s\n" program mode "IR bytes" "exe bytes" seconds
+for program in examples/*.rpn; do
+  name=$(basename "$program" .rpn)
+  for mode in -O0 default; do
+    if [ "$mode" = -O0 ]; then "$rpn" -O0 "$program" > "$dir/$name.ll"; else "$rpn" "$program" > "$dir/$name.ll"; fi
+    clang -x ir -O2 -o "$dir/$name" "$dir/$name.ll" || exit 1
+    start=$(date +%s.%N)
+    "$dir/$name" > /dev/null
+    end=$(date +%s.%N)
+    printf "%-16s %-8s %10d %10d %8.3f\n" "$name" "$mode" "$(wc -c < "$dir/$name.ll")" "$(wc -c < "$dir/$name")" \
+      "$(awk -v start="$start" -v end="$end" 'BEGIN { print end - start }')"
+  done
+done
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Write an RPN program with lots of small definitions, for timing how long rpn takes to optimize
+# a compiled file with different numbers of threads:
+#
+#   benchmarks/many-words.sh 20000 > many.rpn
+#   time ./rpn -j 1 many.rpn > /dev/null
+#   time ./rpn many.rpn > /dev/null
+#
+# Every word is used, so none of them are dropped before being optimized.
+
+count=${1:-20000}
+
+awk -v count="$count" 'BEGIN {
+  print ": w0 { a b } a b + a b * - ;"
+  for (i = 1; i < count; i++) {
+    print ": w" i " { a b } a b w" i - 1 " a 2 * + b - ;"
+    print i " " i + 1 " w" i " ."
+  }
+}'
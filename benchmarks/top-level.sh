@@ -0,0 +1,15 @@
+#!/bin/sh
+# Write an RPN program with lots of top-level code (1 2 + drop, over and over), for timing how 
+# long rpn takes to compile it with and without splitting it into chunks:
+#
+#   benchmarks/top-level.sh 1000000 > big.rpn
+#   time ./rpn --chunk-size 0 big.rpn > /dev/null
+#   time ./rpn big.rpn > /dev/null
+#
+# The argument is the number of words, rounded down to a multiple of 4.
+
+words=${1:-1000000}
+
+awk -v words="$words" 'BEGIN {
+  for (i = 0; i + 4 <= words; i += 4) print "1 2 + drop"
+}'
@@ -6,22 +6,55 @@
 // TODO: Consistency about "static" functions
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csetjmp>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <exception>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include <unistd.h>
+#include "rpn.h"
 #include "llvm/Analysis/Verifier.h"
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JIT.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Linker.h"
 #include "llvm/PassManager.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_os_ostream.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Support/TargetSelect.h"
 
+#ifdef RPN_EMBEDDED_RUNTIME
+#include "runtime.inc"  // the output of "rpn --emit-runtime > runtime.bc; xxd -i runtime.bc > runtime.inc"
+#endif
+
 //TODO: Take this stuff out of global scope?
 using namespace llvm;
 
@@ -31,15 +64,9 @@ static IRBuilder<> builder(context);
 
 static ExecutionEngine *TheExecutionEngine;
 
-GlobalVariable *TheStack;
-
-StructType *stackItemType; 
-PointerType *stackItemPointerType;
+GlobalVariable *TheStack;  // points to the top of the stack
+GlobalVariable *TheStackBottom;  // points just past the bottom of the stack
 
-Function *malloc_;
-FunctionType *mallocType;
-Function *free_;
-FunctionType *freeType;
 Function *printf_;
 FunctionType *printfType;
 
@@ -57,7 +84,7 @@ Function *lt;
 Function *gt;
 Function *eq;
 
-Function *dup;
+Function *dupl;  // not "dup", which unistd.h declares
 Function *swa;
 Function *drop;
 Function *over;
@@ -70,24 +97,92 @@ Function *dotS;
 
 Value *fstring;
 
-std::map<std::string, Function *> words;
-std::map<std::string, Value *> currentLocals;
+std::vector<Value *> currentLocals;  // allocas (or plain values, in register code) for the locals of the definition we're generating code for
+std::vector<Value *> virtualStack;  // the stack while generating register code, top last
+std::map<std::string, unsigned> localIndices;  // names of the locals of the definition we're parsing
 
 std::istream *inputStream;
 
 std::stack<BasicBlock *> beginBlocks;
 std::stack<BasicBlock *> exitBlocks;
 
-uint64_t stackItemSize;
+class WordAST;
+class DefinitionAST;
+class ImageAST;
+class MemoStatsAST;
+struct Word;
+
+// Instructions for the threaded code interpreter
+enum OpCode { 
+  OP_PUSH,  // push number
+  OP_CALL,  // run word
+  OP_LOCALS,  // pop index values into the current call's locals
+  OP_LOCAL,  // push local number index
+  OP_BRANCH_IF_FALSE,  // pop, and jump to index if the value was false
+  OP_BRANCH,  // jump to index
+  OP_RECURSE,  // run the word being interpreted again
+  OP_IMAGE,  // save or load an image
+  OP_MEMO_STATS,  // print how the memo words' caches are doing
+  OP_RETURN
+};
+
+struct ThreadedOp {
+  OpCode op;
+  union {
+    double number;
+    Word *word;
+    unsigned index;
+    ImageAST *image;
+    MemoStatsAST *stats;
+  };
+  ThreadedOp(OpCode Op) : op(Op), index(0) {}
+};
 
-struct StackItem {
-  Value *val;
-  Value *ptr;  // Maybe I should use more specific types where applicable?
+// What we know about how many items a word takes from the stack and leaves on it
+enum EffectState {
+  EFFECT_UNKNOWN,  // not worked out yet
+  EFFECT_INFERRING,  // being worked out right now (so a call to the word is a recursive call)
+  EFFECT_STATIC,  // always the same, so inputs and outputs are valid
+  EFFECT_DYNAMIC  // depends on what's on the stack, or we couldn't tell
 };
 
-class WordAST;
+struct Word {
+  // An entry in the dictionary. Built-in words come with a function. User definitions start out with 
+  // just their AST and threaded code, and only get a function once they've been run often enough.
+
+  std::string name;
+  DefinitionAST *definition;  // 0 for built-ins
+  std::vector<ThreadedOp> code;
+  Function *function;  // 0 until we generate code for the word
+  std::atomic<void (*)()> native;  // 0 until the JIT compiles the function (possibly on the compiler thread)
+  unsigned calls;  // number of times the word has been interpreted
+  std::atomic<unsigned> users;  // references from the dictionary and from code that calls this word
+
+  EffectState effect;
+  int inputs;  // number of items the word pops, if its effect is static
+  int outputs;  // number of items it leaves in their place
+  Function *registerFunction;  // takes the inputs as parameters and returns the outputs, if there is one
+  bool pure;  // for words without definitions: whether they only use and affect the stack (see isPure)
+  GlobalVariable *memoCache;  // for memo words whose register function caches results (see buildMemoLookup)
+  GlobalVariable *memoStats;  // that cache's hits and misses
+  void *memoMemory;  // where the JIT keeps memoCache and memoStats, so they can be freed with the word
+
+  Word(std::string Name) : name(Name), definition(0), function(0), native(0), calls(0), users(0), 
+    effect(EFFECT_UNKNOWN), inputs(0), outputs(0), registerFunction(0), pure(false), memoCache(0), memoStats(0), 
+    memoMemory(0) {}
+};
+
+std::map<std::string, Word *> words;
+std::map<std::string, Word *> memoWords;  // the dictionary's memo words, each holding a reference
+
+void releaseWord(Word *word);  // drop a reference to word, retiring it once nothing can call it
+
+std::stack<unsigned> beginOps;  // like beginBlocks and exitBlocks, but for threaded code
+std::stack<std::vector<unsigned> > exitOps;
 
 Function *buildFunction(std::string);  
+bool inferStackEffect(Word *word);
+void optimizeForJIT(Word *word);
 
 // TODO: Move the stack management into its own class maybe
 
@@ -107,21 +202,26 @@ static Value *getDouble(double x) {
   return ConstantFP::get(getGlobalContext(), APFloat(x));
 }
 
-////////////////////
-// Exceptions
-////////////////////
-
-class CompilerException: public std::runtime_error {
-  public:
-    CompilerException(std::string const& whatValue) : std::runtime_error(whatValue) {};
-};
-
 ////////////////////
 // Tokenizing
 ////////////////////
 
 bool showPrompt = false;  // show prompt when getting next line?
 
+// Lexer state shared by getNextChar and setInput
+static std::string theLine = " ";
+static int lastChar = ' ';
+static std::string::iterator pos = theLine.begin();
+
+static void setInput(std::istream *stream) {
+  // Start reading tokens from stream, forgetting anything left over from the previous input
+
+  inputStream = stream;
+  theLine = " ";
+  lastChar = ' ';
+  pos = theLine.begin();
+}
+
 static int getNextChar(bool advance) {
   // returns the next character from stdin (or returns the last char read if !advance)
 
@@ -130,10 +230,6 @@ static int getNextChar(bool advance) {
   // another way to achieve that, and might be more idiomatic, so something to consider.
   // It's also possible this could work without even sharing a char buffer
 
-  static std::string theLine = " ";
-  static int lastChar = ' ';
-  static std::string::iterator pos = theLine.begin();
-
   if (advance) {
     pos++;
     if (pos == theLine.end()) {
@@ -148,6 +244,18 @@ static int getNextChar(bool advance) {
   //currently this is really nasty
 }
 
+static bool inputLeftOver() {
+  // Whether reading has gone past anything that hasn't been used yet - the rest of the current line,
+  // or input buffered ahead of it. Only a terminal gives us input a line at a time.
+
+  if (inputStream != &std::cin || !isatty(STDIN_FILENO)) return true;
+  for (std::string::iterator p = pos; p != theLine.end(); ++p) {
+    if (!isspace(*p)) return true;
+  }
+  return false;
+
+}
+
 static void dropLine() {
   // consumes input until the next newline or until EOF
 
@@ -156,7 +264,7 @@ static void dropLine() {
 
 }
 
-static std::string gettok() {
+static std::string gettok(bool keepCase = false) {
 
   std::string tokenString;
   
@@ -173,8 +281,8 @@ static std::string gettok() {
     currentChar = getNextChar(true);
   }
 
-  // forth is case insensitive, so let's be case insensitive
-  std::transform(tokenString.begin(), tokenString.end(), tokenString.begin(), ::tolower); 
+  // forth is case insensitive, so let's be case insensitive (except for things like file names)
+  if (!keepCase) std::transform(tokenString.begin(), tokenString.end(), tokenString.begin(), ::tolower); 
 
   return tokenString;  
 }
@@ -184,18 +292,48 @@ static std::string gettok() {
 // AST Definitions
 ////////////////////
 
+struct StackEffect {
+  // Tracks what a sequence of words does to the stack. depth is how much the stack has grown (or 
+  // shrunk, if negative) since the start, and lowest is the least it's been.
+
+  int depth;
+  int lowest;
+
+  StackEffect() : depth(0), lowest(0) {}
+  void apply(int in, int out) {
+    depth -= in;
+    lowest = std::min(lowest, depth);
+    depth += out;
+  }
+  int inputs() { return -lowest; }  // items used from below where the stack started
+  int outputs() { return depth - lowest; }  // items left in their place
+};
+
 class WordAST {
 // Base class for other word types
 public: 
   virtual ~WordAST() {};  // Why does this destructor need to be declared?
   virtual void codeGen() = 0;
+  virtual void threadCode(std::vector<ThreadedOp> &code) = 0;  // append threaded code for the interpreter
+  virtual bool addStackEffect(StackEffect &effect) = 0;  // false if the effect isn't known until run time
+  virtual void registerCodeGen() = 0;  // generate code that works on virtualStack (see buildRegisterWord)
 };
 
 class BasicWordAST : public WordAST {
-  std::string name;
+  Word *word;
+  bool holdsReference;
 public:
-  BasicWordAST(std::string Name) : name(Name) {}
+  BasicWordAST(Word *TheWord) : word(TheWord) {
+    // A recursive word referring to itself (so it has no code yet) doesn't count as a user, since 
+    // otherwise it could never be retired
+    holdsReference = word -> definition != 0 || word -> function != 0;
+    if (holdsReference) ++word -> users;
+  }
+  virtual ~BasicWordAST() { if (holdsReference) releaseWord(word); }
   virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
 };
 
 class NumberAST : public WordAST {
@@ -203,6 +341,9 @@ class NumberAST : public WordAST {
 public:
   NumberAST(double Val) : val(Val) {}
   virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
 };
 
 class IfAST : public WordAST {
@@ -210,55 +351,131 @@ class IfAST : public WordAST {
   std::vector<WordAST *> elseContent;
 public:
   IfAST(std::vector<WordAST *> ThenContent, std::vector<WordAST *> ElseContent) : thenContent(ThenContent), elseContent(ElseContent) {}
+  virtual ~IfAST();
   virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
 };
 
 class BeginAST : public WordAST {
 public:
   BeginAST() {};
   virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
 };
 
 class AgainAST : public WordAST { 
 public:
   AgainAST() {};
   virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
 };
 
 class WhileAST : public WordAST {
 public:
   WhileAST() {};
   virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
 };
 
 class DefinitionAST : public WordAST {
   std::vector<WordAST *> content;
-  std::string name;
+  Word *word;
   std::vector<std::string> locals;
   bool recursive;
+  bool memo;  // cache results (see buildMemoLookup)
 public:
-  DefinitionAST(std::string Name, bool Recursive, std::vector<std::string> Locals, std::vector<WordAST *> Content) : 
-    name(Name), recursive(Recursive), locals(Locals), content(Content) {}
+  DefinitionAST(Word *TheWord, bool Recursive, bool Memo, std::vector<std::string> Locals, std::vector<WordAST *> Content) : 
+    word(TheWord), recursive(Recursive), memo(Memo), locals(Locals), content(Content) {}
+  virtual ~DefinitionAST();
   virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
+  void threadDefinition();  // fill in word's threaded code
+  bool addBodyStackEffect(StackEffect &effect);  // the effect of running word
+  void buildRegisterWord();
+  Word *getWord() { return word; }
 };
 
 class LocalRefAST : public WordAST {
-  std::string name;
+  unsigned index;  // position in the definition's list of locals
 public:
-  LocalRefAST(std::string Name) : name(Name) {};
+  LocalRefAST(unsigned Index) : index(Index) {};
   virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
 };  // maybe merge this class with BasicWord
 
 class RecurseAST : public WordAST {
 public:
   virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
 };
 
 class CommentAST : public WordAST {
 public:
   virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
+};
+
+class ImageAST : public WordAST {
+  std::string filename;
+  bool saving;  // save-image if true, load-image otherwise
+public:
+  ImageAST(std::string Filename, bool Saving) : filename(Filename), saving(Saving) {}
+  virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
+  void run();
+};
+
+class MemoStatsAST : public WordAST {
+  std::vector<Word *> statsWords;  // the memo words defined when memo-stats was parsed
+public:
+  MemoStatsAST(std::vector<Word *> StatsWords) : statsWords(StatsWords) {
+    for (unsigned idx = 0; idx < statsWords.size(); ++idx) ++statsWords[idx] -> users;
+  }
+  virtual ~MemoStatsAST() {
+    for (unsigned idx = 0; idx < statsWords.size(); ++idx) releaseWord(statsWords[idx]);
+  }
+  virtual void codeGen();
+  virtual void threadCode(std::vector<ThreadedOp> &code);
+  virtual bool addStackEffect(StackEffect &effect);
+  virtual void registerCodeGen();
+  void run();
 };
 
+void deleteContent(std::vector<WordAST *> &content) {
+  // Delete a list of words. Definitions inside the list belong to the words they define, so they stay.
+  for (unsigned idx = 0; idx < content.size(); ++idx) {
+    if (!dynamic_cast<DefinitionAST *>(content[idx])) delete content[idx];
+  }
+  content.clear();
+}
+
+IfAST::~IfAST() {
+  deleteContent(thenContent);
+  deleteContent(elseContent);
+}
+
+DefinitionAST::~DefinitionAST() {
+  deleteContent(content);
+}
+
 
 ////////////////////
 // Parsing
@@ -271,9 +488,11 @@ std::string getNextToken() {
   return curTok = gettok();
 }
 
+unsigned definitionDepth = 0;  // how many definitions we're in the middle of parsing
+
 BasicWordAST *parseBasicWord() {
-  std::string name = curTok;
-  return new BasicWordAST(name);
+  // Words are looked up as they're parsed, so redefining a word later doesn't affect existing uses of it
+  return new BasicWordAST(words[curTok]);
 }
 
 NumberAST *parseNumber() {
@@ -289,22 +508,29 @@ IfAST *parseIf() {
   
   getNextToken();  // Eat the if
 
-  while (curTok != "else" && curTok != "then") {
-    if (curTok == "") throw CompilerException("then or else expected");
-    thenContent.push_back(parseToken(curTok));
-    getNextToken();
-  }
-  
-  if (curTok == "then") {
-    return new IfAST(thenContent, elseContent);
-  }
+  try {
+    while (curTok != "else" && curTok != "then") {
+      if (curTok == "") throw CompilerException("then or else expected");
+      thenContent.push_back(parseToken(curTok));
+      getNextToken();
+    }
+    
+    if (curTok == "then") {
+      return new IfAST(thenContent, elseContent);
+    }
 
-  getNextToken();  // Eat else
+    getNextToken();  // Eat else
 
-  while (curTok != "then") {  // If we haven't already hit a then, need to keep going until we do
-    if (curTok == "") throw CompilerException("then expected");
-    elseContent.push_back(parseToken(curTok));
-    getNextToken();
+    while (curTok != "then") {  // If we haven't already hit a then, need to keep going until we do
+      if (curTok == "") throw CompilerException("then expected");
+      elseContent.push_back(parseToken(curTok));
+      getNextToken();
+    }
+  } catch (CompilerException e) {
+    // What we've parsed holds references to the words it uses
+    deleteContent(thenContent);
+    deleteContent(elseContent);
+    throw;
   }
 
   return new IfAST(thenContent, elseContent);
@@ -329,44 +555,101 @@ WhileAST *parseWhile() {
 
 }
 
+static bool isPure(Word *word, std::set<Word *> &checked) {
+  // Whether running word only depends on and affects the stack, so its results could be cached. 
+  // Goes by the threaded code, since that's there as soon as a word is parsed. checked holds the 
+  // words already looked at, which takes care of recursion.
+
+  if (!word -> definition) return word -> pure;
+  if (!checked.insert(word).second) return true;
+
+  for (unsigned idx = 0; idx < word -> code.size(); ++idx) {
+    const ThreadedOp &op = word -> code[idx];
+    if (op.op == OP_IMAGE || op.op == OP_MEMO_STATS) return false;
+    if (op.op == OP_CALL && !isPure(op.word, checked)) return false;
+  }
+  return true;
+
+}
+
 DefinitionAST *parseDefinition() {  // Note: this will allow colon definitions inside : defs - not sure it works that way in forth
   getNextToken();  // eat :
   
   std::string name = curTok;  // the name we want to set for our word is the first token we get after the :
+  Word *word = new Word(name);
+  Word *previous = words.count(name) == 1 ? words[name] : 0;  // in case we need to undo a recursive definition
 
   getNextToken();  // eat name
 
   std::vector<std::string> locals;  // maybe use std::set for this because I'm mostly searching it and don't want dupes -- but I care about order
- 
+  std::vector<WordAST *> content;
   bool recursive = false;
-  if (curTok == "recursive") {  // the use of the "recursive" word is nonstandard forth per gforth manual (but seems nice)
-    recursive = true; 
-    words[name];  // add this to our word list (even though we don't actually have code for it yet) 
-    // need a way to undo that definition if something fails
-    getNextToken();  // eat recursive
-  } 
-
-  if (curTok == "{") {
-    // word has locals
-    getNextToken();  // eat {
-    while (curTok != "}") {
-      if (curTok == "") throw CompilerException("} expected");  // eof before end of locals definition
-      locals.push_back(curTok);  // report on duplicates?
-      currentLocals[curTok] = Constant::getNullValue(Type::getDoubleTy(getGlobalContext()));  // set to null for now - we'll do more when we codegen
-      getNextToken(); 
+  bool memo = false;
+
+  definitionDepth++;
+  try {
+    while (curTok == "recursive" || curTok == "memo") {
+      if (curTok == "recursive" && !recursive) {  // the use of the "recursive" word is nonstandard forth per gforth manual (but seems nice)
+        recursive = true; 
+        words[name] = word;  // add this to our word list (even though we don't actually have code for it yet) 
+      } else if (curTok == "memo") {
+        memo = true;
+      }
+      getNextToken();  // eat recursive or memo
     } 
-    getNextToken();  // eat }
+
+    if (curTok == "{") {
+      // word has locals
+      getNextToken();  // eat {
+      while (curTok != "}") {
+        if (curTok == "") throw CompilerException("} expected");  // eof before end of locals definition
+        localIndices[curTok] = locals.size();  // report on duplicates?
+        locals.push_back(curTok);
+        getNextToken(); 
+      } 
+      getNextToken();  // eat }
+    }
+
+    while (curTok != ";") {
+      if (curTok == "") throw CompilerException("; expected");  // eof before end of definition
+      content.push_back(parseToken(curTok));
+      getNextToken();
+    }  
+
+    word -> definition = new DefinitionAST(word, recursive, memo, locals, content);
+    word -> definition -> threadDefinition();
+
+    std::set<Word *> checked;
+    if (memo && !isPure(word, checked)) throw CompilerException("memo words can't print, read clocks or counters, or use words that do");
+  } catch (CompilerException e) {
+    definitionDepth--;
+    localIndices.clear();
+    if (recursive) {
+      if (previous) words[name] = previous;
+      else words.erase(name);
+    }
+    if (word -> definition) delete word -> definition;
+    else deleteContent(content);
+    delete word;
+    throw;
   }
 
-  std::vector<WordAST *> content;
+  definitionDepth--;
+  localIndices.clear();
+  words[name] = word;
+  ++word -> users;  // the dictionary's reference
+  if (previous) releaseWord(previous);
 
-  while (curTok != ";") {
-    if (curTok == "") throw CompilerException("; expected");  // eof before end of definition
-    content.push_back(parseToken(curTok));
-    getNextToken();
-  }  
+  if (memoWords.count(name) == 1) {
+    releaseWord(memoWords[name]);
+    memoWords.erase(name);
+  }
+  if (memo) {
+    memoWords[name] = word;
+    ++word -> users;
+  }
 
-  return new DefinitionAST(name, recursive, locals, content);
+  return word -> definition;
 }
 
 WordAST *parseComment() {
@@ -382,11 +665,32 @@ WordAST *parseComment() {
 
 }
 
+ImageAST *parseImage(bool saving) {
+  // save-image and load-image are followed by a file name
+
+  if (definitionDepth > 0) throw CompilerException(curTok + " can't be used inside a definition");
+
+  std::string filename = gettok(true);
+  if (filename == "") throw CompilerException("file name expected");
+
+  return new ImageAST(filename, saving);
+}
+
+MemoStatsAST *parseMemoStats() {
+
+  std::vector<Word *> statsWords;
+  for (std::map<std::string, Word *>::iterator it = memoWords.begin(); it != memoWords.end(); ++it) {
+    statsWords.push_back(it -> second);
+  }
+  return new MemoStatsAST(statsWords);
+
+}
+
 WordAST *parseToken(std::string tokenString) { 
   // General function for parsing any top level token
 
-  if (currentLocals.count(tokenString) == 1) {
-    return new LocalRefAST(tokenString);
+  if (localIndices.count(tokenString) == 1) {
+    return new LocalRefAST(localIndices[tokenString]);
   } else if (words.count(tokenString) == 1) {  // test if our list of defined words contains the tokenString
     // If so, this is just a basic word
     // Currently I search words for tokenString twice - once here and once during codegen - fix?
@@ -411,6 +715,12 @@ WordAST *parseToken(std::string tokenString) {
     return new RecurseAST();
   } else if (tokenString == "(") {  // beginning of a comment
     return parseComment();
+  } else if (tokenString == "save-image") {
+    return parseImage(true);
+  } else if (tokenString == "load-image") {
+    return parseImage(false);
+  } else if (tokenString == "memo-stats") {
+    return parseMemoStats();
   } else if (tokenString == "") {  // eof
     return 0;
   }
@@ -432,8 +742,15 @@ void codeGenMultiple(std::vector<WordAST *> content) {
   }
 }
 
+Function *compileWord(Word *word) {
+  // Get word's function, generating code for it first if needed
+
+  if (!word -> function) word -> definition -> codeGen();
+  return word -> function;
+}
+
 void BasicWordAST::codeGen() {
-  builder.CreateCall(words[name]);
+  builder.CreateCall(compileWord(word));
 }
 
 void NumberAST::codeGen() {
@@ -523,28 +840,46 @@ void WhileAST::codeGen() {
 
 void DefinitionAST::codeGen() {
 
+  if (word -> function) return;  // code was already generated, e.g. because another word uses this one
+
+  // We might be in the middle of generating code for another word, so save where we were
   BasicBlock *originalBlock = builder.GetInsertBlock();
+  std::vector<Value *> originalLocals;
+  originalLocals.swap(currentLocals);
+  std::vector<Value *> originalStack;
+  originalStack.swap(virtualStack);
 
-  Function *f = buildFunction(name);
- 
-  words[name] = f; // maybe provide for the ability to undo this if something fails
+  if (inferStackEffect(word)) {
+    buildRegisterWord();
+  } else {
+    Function *f = buildFunction(word -> name);
+   
+    word -> function = f;
 
-  unsigned idx;
-  for (std::vector<std::string>::reverse_iterator i = locals.rbegin(); i != locals.rend(); ++i) {
-    currentLocals[*i] = builder.CreateAlloca(Type::getDoubleTy(getGlobalContext()));
-    builder.CreateStore(builder.CreateCall(pop), currentLocals[*i]); 
-  }
+    currentLocals.resize(locals.size());
+    for (unsigned idx = locals.size(); idx > 0; --idx) {  // the rightmost local gets the top of the stack
+      currentLocals[idx - 1] = builder.CreateAlloca(Type::getDoubleTy(getGlobalContext()));
+      builder.CreateStore(builder.CreateCall(pop), currentLocals[idx - 1]); 
+    }
 
-  codeGenMultiple(content);  
+    codeGenMultiple(content);  
 
-  builder.CreateRetVoid();
+    builder.CreateRetVoid();
+
+    // Add function validation and optimization here, check for conflicting names
+    verifyFunction(*f); 
+  }
 
-  // Add function validation and optimization here, check for conflicting names
-  verifyFunction(*f); 
+  // Compiled files are optimized as a whole later (see optimizeFunctions), but JIT compiled words 
+  // are optimized one at a time. Doing it here rather than when the word is JIT compiled also 
+  // catches the words it calls, which the JIT compiles along with it.
+  if (TheExecutionEngine) optimizeForJIT(word);
 
-  currentLocals.clear();
+  currentLocals.swap(originalLocals);
+  virtualStack.swap(originalStack);
 
-  builder.SetInsertPoint(originalBlock);
+  if (originalBlock) builder.SetInsertPoint(originalBlock);
+  else builder.ClearInsertionPoint();
 
 }
 
@@ -556,105 +891,176 @@ void RecurseAST::codeGen() {
 }
 
 void LocalRefAST::codeGen() {
-  builder.CreateCall(push, builder.CreateLoad(currentLocals[name]));
+  builder.CreateCall(push, builder.CreateLoad(currentLocals[index]));
 }
 
 void CommentAST::codeGen() {}  // don't do anything for comments
 
+void ImageAST::codeGen() {
+  throw CompilerException("images can only be saved or loaded in the REPL");
+}
 
-/////////////////////////////////////
-// Generating code for built-in words
-/////////////////////////////////////
 
-Type *voidTy = Type::getVoidTy(getGlobalContext());
-Type *doubleTy = Type::getDoubleTy(getGlobalContext());
-Type *int8Ty = Type::getInt8Ty(getGlobalContext());
-Type *int32Ty = Type::getInt32Ty(getGlobalContext());
-Type *int64Ty = Type::getInt64Ty(getGlobalContext());
-PointerType *int8PointerTy = PointerType::get(int8Ty, 0);
+////////////////////
+// Threaded code
+////////////////////
 
-Value *buildGetStackValue(Value *stackItemPtr) {
-  // Generate code to get the value from the stack element pointed to by stackItemPtr
-  
-  Value *idx[] = { getInt32(0), getInt32(0) };
-  Value *valPtr = builder.CreateInBoundsGEP(stackItemPtr, idx, "gettingVal");
-  return builder.CreateLoad(valPtr, "val");
+static unsigned emitOp(std::vector<ThreadedOp> &code, OpCode op) {
+  // Append op to code and return its position, so jumps can be filled in later
+  code.push_back(ThreadedOp(op));
+  return code.size() - 1;
+}
 
+void threadMultiple(std::vector<WordAST *> content, std::vector<ThreadedOp> &code) {
+  for (unsigned idx = 0; idx < content.size(); ++idx) {
+    content.at(idx) -> threadCode(code);
+  }
 }
 
-void buildSetStackValue(Value *stackItemPtr, Value *newValue) {
-  // Generate code to set the value from the stack element pointed to by stackItemPtr
-  
-  Value *idx[] = { getInt32(0), getInt32(0) };
-  Value *valPtr = builder.CreateInBoundsGEP(stackItemPtr, idx, "gettingVal");
-  builder.CreateStore(newValue, valPtr);
+void BasicWordAST::threadCode(std::vector<ThreadedOp> &code) {
+  code[emitOp(code, OP_CALL)].word = word;
+}
 
+void NumberAST::threadCode(std::vector<ThreadedOp> &code) {
+  code[emitOp(code, OP_PUSH)].number = val;
 }
 
-Value *buildGetStackPointer(Value *stackItemPtr) {
-  // Given a pointer to a stack item, return the pointer to the next item down the stack
-  
- Value *idx[] = { getInt32(0), getInt32(1) }; 
- Value *ptrPtr = builder.CreateInBoundsGEP(stackItemPtr, idx, "gettingPtr");
- return builder.CreateLoad(ptrPtr, "ptr");
+void IfAST::threadCode(std::vector<ThreadedOp> &code) {
+
+  unsigned ifOp = emitOp(code, OP_BRANCH_IF_FALSE);
+  threadMultiple(thenContent, code);
+
+  if (elseContent.size() > 0) {
+    unsigned skipElseOp = emitOp(code, OP_BRANCH);
+    code[ifOp].index = code.size();
+    threadMultiple(elseContent, code);
+    code[skipElseOp].index = code.size();
+  } else {
+    code[ifOp].index = code.size();
+  }
 
 }
 
-Value *buildSetStackPointer(Value *stackItemPtr, Value *newPtr) {
-  // Generate code to set the pointer of the stack element pointed to by stackItemPtr
-  
- Value *idx[] = { getInt32(0), getInt32(1) }; 
- Value *ptrPtr = builder.CreateInBoundsGEP(stackItemPtr, idx, "gettingPtr");
- return builder.CreateStore(newPtr, ptrPtr);
+void BeginAST::threadCode(std::vector<ThreadedOp> &code) {
+  beginOps.push(code.size());
+  exitOps.push(std::vector<unsigned>());
+}
+
+void AgainAST::threadCode(std::vector<ThreadedOp> &code) {
+
+  if (beginOps.empty()) throw CompilerException("again without begin");
+
+  code[emitOp(code, OP_BRANCH)].index = beginOps.top();
+
+  std::vector<unsigned> &exits = exitOps.top();  // each while in the loop jumps to here
+  for (unsigned idx = 0; idx < exits.size(); ++idx) code[exits[idx]].index = code.size();
+
+  beginOps.pop();
+  exitOps.pop();
 
 }
 
-void buildSetStackItem(Value *stackItemPtr, Value *newValue, Value *newPtr) { // maybe stackItemPtr should have the right type
-  // Generate code to set the fields of a stack item structure
-  
-  buildSetStackValue(stackItemPtr, newValue);
-  buildSetStackPointer(stackItemPtr, newPtr);
+void WhileAST::threadCode(std::vector<ThreadedOp> &code) {
+  if (exitOps.empty()) throw CompilerException("while without begin");
+  exitOps.top().push_back(emitOp(code, OP_BRANCH_IF_FALSE));
+}
+
+void DefinitionAST::threadCode(std::vector<ThreadedOp> &code) {}  // nothing happens at run time
+
+void DefinitionAST::threadDefinition() {
+
+  unsigned loopDepth = beginOps.size();
+
+  if (locals.size() > 0) word -> code[emitOp(word -> code, OP_LOCALS)].index = locals.size();
+  threadMultiple(content, word -> code);
+  emitOp(word -> code, OP_RETURN);
+
+  if (beginOps.size() != loopDepth) {
+    while (beginOps.size() > loopDepth) {
+      beginOps.pop();
+      exitOps.pop();
+    }
+    throw CompilerException("again expected");
+  }
+
+}
 
+void LocalRefAST::threadCode(std::vector<ThreadedOp> &code) {
+  code[emitOp(code, OP_LOCAL)].index = index;
 }
 
-struct StackItem buildGetStackItem(Value *stackItemPtr) {
-  // Generate code to retrieve the fields of a stack item structure
+void RecurseAST::threadCode(std::vector<ThreadedOp> &code) {
+  emitOp(code, OP_RECURSE);
+}
+
+void CommentAST::threadCode(std::vector<ThreadedOp> &code) {}
+
+void ImageAST::threadCode(std::vector<ThreadedOp> &code) {
+  code[emitOp(code, OP_IMAGE)].image = this;
+}
+
+
+/////////////////////////////////////
+// Generating code for built-in words
+/////////////////////////////////////
+
+Type *voidTy = Type::getVoidTy(getGlobalContext());
+Type *doubleTy = Type::getDoubleTy(getGlobalContext());
+Type *int8Ty = Type::getInt8Ty(getGlobalContext());
+Type *int32Ty = Type::getInt32Ty(getGlobalContext());
+Type *int64Ty = Type::getInt64Ty(getGlobalContext());
+PointerType *int8PointerTy = PointerType::get(int8Ty, 0);
+
+PointerType *doublePointerTy = PointerType::get(doubleTy, 0);
+
+// The stack is an array of doubles that grows downwards, inside a mapping with inaccessible guard 
+// pages at either end (see setUpStack and buildStackSetup). thestack points at the top item, and 
+// stackbottom just past the bottom one, so the stack is empty when they're equal. Going past either
+// end of the stack touches a guard page, which the operating system catches for us, so none of the 
+// code here has to check for underflow or overflow.
 
-  struct StackItem item;
+Value *buildGetStackSlot(unsigned depth) {
+  // Generate code for the address of the item depth places down from the top of the stack
 
-  item.val = buildGetStackValue(stackItemPtr);
+  Value *top = builder.CreateLoad(TheStack, "stackTop");
+  if (depth == 0) return top;
+  return builder.CreateConstGEP1_32(top, depth, "stackSlot");
 
-  item.ptr = buildGetStackPointer(stackItemPtr);
+}
 
-  return item;
+Value *buildGetStackValue(unsigned depth) {
+  // Generate code to get the value depth places down from the top of the stack
+  return builder.CreateLoad(buildGetStackSlot(depth), "val");
+}
 
+void buildSetStackValue(unsigned depth, Value *newValue) {
+  // Generate code to set the value depth places down from the top of the stack
+  builder.CreateStore(newValue, buildGetStackSlot(depth));
 }
 
 void buildPush(Value *x) {
   // Generate code to push a new number to the stack
 
-  StackItem stackTop = buildGetStackItem(TheStack); 
-
-  Value *voidPtr = builder.CreateCall(malloc_, getInt64(stackItemSize), "mallocResult");
-  Value *newItemPtr = builder.CreateBitCast(voidPtr, stackItemPointerType, "newStackItem");
-
-  buildSetStackItem(newItemPtr, stackTop.val, stackTop.ptr);  // Copy the current top of the stack to the new item
-  buildSetStackItem(TheStack, x, newItemPtr);  // Then put the new value in the top of the stack, pointing it to our new item
+  Value *newTop = builder.CreateGEP(builder.CreateLoad(TheStack, "stackTop"), getInt64(-1), "newTop");
+  builder.CreateStore(x, newTop);
+  builder.CreateStore(newTop, TheStack);
 
 }
 
 Value *buildPop() {
-  // Generate code to pop an item off the stack. Returns the Value* indicating what was popped
-  
-  StackItem oldStackTop = buildGetStackItem(TheStack);
-  StackItem newStackTop = buildGetStackItem(oldStackTop.ptr);
-  
-  buildSetStackItem(TheStack, newStackTop.val, newStackTop.ptr);
+  // Generate code to pop an item off the stack. Returns the Value* indicating what was popped.
+  // The load is volatile so that it stays even if the value isn't used, so that popping an empty 
+  // stack always reaches the guard page.
   
-  Value *castPtr = builder.CreateBitCast(oldStackTop.ptr, PointerType::get(Type::getInt8Ty(getGlobalContext()), 0));
-  builder.CreateCall(free_, castPtr);
+  Value *top = builder.CreateLoad(TheStack, "stackTop");
+#ifdef RPN_UNCHECKED_STACK
+  Value *val = builder.CreateLoad(top, "val");
+#else
+  Value *val = builder.CreateLoad(top, true, "val");
+#endif
+  builder.CreateStore(builder.CreateConstGEP1_32(top, 1, "newTop"), TheStack);
 
-  return oldStackTop.val;
+  return val;
 
 }
 
@@ -688,14 +1094,89 @@ void buildPrintDouble(Value *doub) {
   builder.CreateCall(printf_, opts, "printfCall");
 }
 
+Value *buildTicks() {
+  // Generate code to read the processor's cycle counter (always 0 on targets that don't have one)
+  Function *readCycleCounter = Intrinsic::getDeclaration(theModule, Intrinsic::readcyclecounter);
+  return builder.CreateUIToFP(builder.CreateCall(readCycleCounter, "cycles"), doubleTy, "ticks");
+}
+
+Value *buildUsecs() {
+  // Generate code to read the monotonic clock in microseconds. Only the difference between two
+  // readings means anything.
+
+  Type *timespecFields[] = { IntegerType::get(getGlobalContext(), 8 * sizeof(time_t)),
+    IntegerType::get(getGlobalContext(), 8 * sizeof(long)) };
+  StructType *timespecTy = StructType::get(getGlobalContext(), timespecFields);
+  Type *clockParams[] = { int32Ty, PointerType::get(timespecTy, 0) };
+  Constant *clockGettime = theModule -> getOrInsertFunction("clock_gettime", FunctionType::get(int32Ty, clockParams, false));
+
+  Value *time = builder.CreateAlloca(timespecTy, 0, "time");
+  builder.CreateCall2(clockGettime, getInt32(CLOCK_MONOTONIC), time);
+  Value *seconds = builder.CreateSIToFP(builder.CreateLoad(builder.CreateStructGEP(time, 0)), doubleTy, "seconds");
+  Value *nanoseconds = builder.CreateSIToFP(builder.CreateLoad(builder.CreateStructGEP(time, 1)), doubleTy, "nanoseconds");
+  return builder.CreateFAdd(builder.CreateFMul(seconds, getDouble(1e6)), builder.CreateFDiv(nanoseconds, getDouble(1e3)), "usecs");
+
+}
+
+#ifdef __linux__
+
+void buildCounterWord(std::string name, uint64_t config) {
+  // Generate a built-in that pushes the count of the hardware event config (one of the
+  // PERF_COUNT_HW_ constants) for the calling thread, in user space only. The counter is opened the
+  // first time the word runs, so that reading counts from 0. If it can't be opened (the kernel or
+  // its perf_event_paranoid setting may not allow it), the word pushes -1.
+
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  Constant *attrBytes = ConstantDataArray::get(getGlobalContext(), ArrayRef<uint8_t>((uint8_t *)&attr, sizeof(attr)));
+  GlobalVariable *attrGlobal = new GlobalVariable(*theModule, attrBytes -> getType(), true, GlobalValue::PrivateLinkage,
+    attrBytes, name + ".attr");
+
+  // The counter's file descriptor, -2 until it's opened
+  GlobalVariable *fd = new GlobalVariable(*theModule, int32Ty, false, GlobalValue::ExternalLinkage,
+    ConstantInt::get(int32Ty, -2), name + ".fd");
+
+  Function *f = buildFunction(name);
+  Value *count = builder.CreateAlloca(int64Ty, 0, "count");
+  BasicBlock *entry = builder.GetInsertBlock();
+  BasicBlock *openBlock = BasicBlock::Create(getGlobalContext(), "open", f);
+  BasicBlock *readBlock = BasicBlock::Create(getGlobalContext(), "read", f);
+  Value *oldFd = builder.CreateLoad(fd, "oldFd");
+  builder.CreateCondBr(builder.CreateICmpEQ(oldFd, getInt32(-2)), openBlock, readBlock);
+
+  builder.SetInsertPoint(openBlock);
+  Constant *syscall_ = theModule -> getOrInsertFunction("syscall", FunctionType::get(int64Ty, int64Ty, true));
+  Value *openArgs[] = { getInt64(SYS_perf_event_open), builder.CreateConstInBoundsGEP2_32(attrGlobal, 0, 0),
+    getInt64(0), getInt64(-1), getInt64(-1), getInt64(0) };  // this thread, any CPU, no group, no flags
+  Value *newFd = builder.CreateTrunc(builder.CreateCall(syscall_, openArgs, "perfEventOpen"), int32Ty, "newFd");
+  builder.CreateStore(newFd, fd);
+  builder.CreateBr(readBlock);
+
+  builder.SetInsertPoint(readBlock);
+  PHINode *counterFd = builder.CreatePHI(int32Ty, 2, "counterFd");
+  counterFd -> addIncoming(oldFd, entry);
+  counterFd -> addIncoming(newFd, openBlock);
+  Type *readParams[] = { int32Ty, int8PointerTy, int64Ty };
+  Constant *read_ = theModule -> getOrInsertFunction("read", FunctionType::get(int64Ty, readParams, false));
+  Value *bytesRead = builder.CreateCall3(read_, counterFd, builder.CreateBitCast(count, int8PointerTy), getInt64(8), "bytesRead");
+  Value *result = builder.CreateSelect(builder.CreateICmpEQ(bytesRead, getInt64(8)),
+    builder.CreateUIToFP(builder.CreateLoad(count), doubleTy), getDouble(-1.0), "counted");
+  builder.CreateCall(push, result);
+  builder.CreateRetVoid();
+
+}
+
+#endif
+
 void codeGenBuiltIns() {
   // Generates the code for some words that we want built into our language (and some code that's useful for defining those words)
 
   // Declare useful external functions
-  mallocType = FunctionType::get(int8PointerTy, int64Ty, false);
-  malloc_ = Function::Create(mallocType, Function::ExternalLinkage, "malloc", theModule);
-  freeType = FunctionType::get(voidTy, int8PointerTy, false);
-  free_ = Function::Create(freeType, Function::ExternalLinkage, "free", theModule); 
   printfType = FunctionType::get(int32Ty, int8PointerTy, true);
   printf_ = Function::Create(printfType, Function::ExternalLinkage, "printf", theModule);
 
@@ -722,72 +1203,72 @@ void codeGenBuiltIns() {
   // Generate code for functions corresponding to various built in words.
   add = buildFunction("add");
   Value *a = builder.CreateCall(pop, "poppedForAdd");
-  Value *b = buildGetStackValue(TheStack);
+  Value *b = buildGetStackValue(0);
   Value *result = builder.CreateFAdd(a, b, "addtmp");
-  buildSetStackValue(TheStack, result);
+  buildSetStackValue(0, result);
   builder.CreateRetVoid();
 
   sub = buildFunction("sub"); 
   a = builder.CreateCall(pop, "poppedForSub");
-  b = buildGetStackValue(TheStack);
+  b = buildGetStackValue(0);
   result = builder.CreateFSub(b, a, "subtmp");
-  buildSetStackValue(TheStack, result);
+  buildSetStackValue(0, result);
   builder.CreateRetVoid();
   
   mul = buildFunction("mul");
   a = builder.CreateCall(pop, "poppedForMul");
-  b = buildGetStackValue(TheStack);
+  b = buildGetStackValue(0);
   result = builder.CreateFMul(b, a, "multmp");
-  buildSetStackValue(TheStack, result);
+  buildSetStackValue(0, result);
   builder.CreateRetVoid();
   
   divi = buildFunction("div"); 
   a = builder.CreateCall(pop, "poppedForMul");
-  b = buildGetStackValue(TheStack);
+  b = buildGetStackValue(0);
   result = builder.CreateFDiv(b, a, "divtmp");
-  buildSetStackValue(TheStack, result);
+  buildSetStackValue(0, result);
   builder.CreateRetVoid();
 
   negate = buildFunction("negate");
-  a = buildGetStackValue(TheStack);
+  a = buildGetStackValue(0);
   result = builder.CreateFNeg(a, "negtmp"); 
-  buildSetStackValue(TheStack, result);
+  buildSetStackValue(0, result);
   builder.CreateRetVoid();
 
   lt = buildFunction("lt");
   a = builder.CreateCall(pop, "poppedForLt");
-  b = buildGetStackValue(TheStack);
+  b = buildGetStackValue(0);
   result = builder.CreateUIToFP(builder.CreateFCmpULT(b, a, "lttmp"), Type::getDoubleTy(getGlobalContext()), "lttmpdbl");
   result = builder.CreateFMul(result, getDouble(-1.0));  // Forth "true" results are -1
-  buildSetStackValue(TheStack, result);
+  buildSetStackValue(0, result);
   builder.CreateRetVoid();
 
   gt = buildFunction("gt");
   a = builder.CreateCall(pop, "poppedForGt");
-  b = buildGetStackValue(TheStack); 
+  b = buildGetStackValue(0); 
   result = builder.CreateUIToFP(builder.CreateFCmpUGT(b, a, "gttmp"), Type::getDoubleTy(getGlobalContext()), "gttmpdbl");
   result = builder.CreateFMul(result, getDouble(-1.0));  // Forth "true" results are -1
-  buildSetStackValue(TheStack, result);
+  buildSetStackValue(0, result);
   builder.CreateRetVoid();
 
   eq = buildFunction("eq");
   a = builder.CreateCall(pop, "poppedForEq");
-  b = buildGetStackValue(TheStack);
+  b = buildGetStackValue(0);
   result = builder.CreateUIToFP(builder.CreateFCmpOEQ(b, a, "eqtmp"), Type::getDoubleTy(getGlobalContext()), "eqtmpdbl"); 
   result = builder.CreateFMul(result, getDouble(-1.0));  // Forth "true" results are -1
-  buildSetStackValue(TheStack, result);
+  buildSetStackValue(0, result);
   builder.CreateRetVoid();
 
-  dup = buildFunction("dup");
-  a = buildGetStackValue(TheStack);
+  dupl = buildFunction("dup");
+  a = buildGetStackValue(0);
   builder.CreateCall(push, a);
   builder.CreateRetVoid();
 
   swa = buildFunction("swap");
-  StackItem top = buildGetStackItem(TheStack);
-  a = buildGetStackValue(top.ptr);
-  buildSetStackValue(TheStack, a);
-  buildSetStackValue(top.ptr, top.val);
+  a = buildGetStackValue(0);
+  b = buildGetStackValue(1);
+  buildSetStackValue(0, b);
+  buildSetStackValue(1, a);
   builder.CreateRetVoid();
 
   drop = buildFunction("drop");
@@ -795,33 +1276,30 @@ void codeGenBuiltIns() {
   builder.CreateRetVoid();
 
   over = buildFunction("over");
-  a = buildGetStackValue(buildGetStackPointer(TheStack));
+  a = buildGetStackValue(1);
   builder.CreateCall(push, a);
   builder.CreateRetVoid();
 
   nip = buildFunction("nip"); 
-  Value *nipped = buildGetStackPointer(TheStack); 
-  Value *castNipped = builder.CreateBitCast(nipped, PointerType::get(Type::getInt8Ty(getGlobalContext()), 0));
-  buildSetStackPointer(TheStack, buildGetStackPointer(nipped));
-  builder.CreateCall(free_, castNipped);
+  a = builder.CreateCall(pop, "poppedForNip");
+  buildSetStackValue(0, a);
   builder.CreateRetVoid();
 
   tuck = buildFunction("tuck");
-  StackItem tucksTop = buildGetStackItem(TheStack);  // Can I generalize this and use it in multiple functions?
-  Value *nextDownsPtr = buildGetStackPointer(tucksTop.ptr);
-  Value *voidPtr = builder.CreateCall(malloc_, getInt64(stackItemSize), "mallocResult");
-  Value *newItemPtr = builder.CreateBitCast(voidPtr, stackItemPointerType, "newStackItem");
-  buildSetStackItem(newItemPtr, tucksTop.val, nextDownsPtr); 
-  buildSetStackPointer(tucksTop.ptr, newItemPtr); 
+  a = buildGetStackValue(0);
+  b = buildGetStackValue(1);
+  buildSetStackValue(1, a);
+  buildSetStackValue(0, b);
+  builder.CreateCall(push, a);
   builder.CreateRetVoid();
 
   rot = buildFunction("rot");
-  StackItem rotsTop = buildGetStackItem(TheStack);  // 3 -> 1 
-  StackItem rotsNext = buildGetStackItem(rotsTop.ptr);  // 2 -> 3
-  Value *rotsBottomVal = buildGetStackValue(rotsNext.ptr); // 1 -> 2
-  buildSetStackValue(TheStack, rotsBottomVal);
-  buildSetStackValue(rotsTop.ptr, rotsTop.val); 
-  buildSetStackValue(rotsNext.ptr, rotsNext.val);
+  Value *rotsTop = buildGetStackValue(0);  // 3 -> 1 
+  Value *rotsNext = buildGetStackValue(1);  // 2 -> 3
+  Value *rotsBottom = buildGetStackValue(2); // 1 -> 2
+  buildSetStackValue(0, rotsBottom);
+  buildSetStackValue(1, rotsTop); 
+  buildSetStackValue(2, rotsNext);
   builder.CreateRetVoid(); 
 
   dot = buildFunction("dot");
@@ -835,159 +1313,2047 @@ void codeGenBuiltIns() {
   BasicBlock *checkBlock = BasicBlock::Create(getGlobalContext(), "checkBlock", dotS);
   BasicBlock *finishedBlock = BasicBlock::Create(getGlobalContext(), "loopFinished", dotS);
   BasicBlock *unfinishedBlock = BasicBlock::Create(getGlobalContext(), "loopUnfinished", dotS);
+  Value *top = builder.CreateLoad(TheStack, "stackTop");
+  Value *bottom = builder.CreateLoad(TheStackBottom, "stackBottom");
   builder.CreateBr(checkBlock);
 
   builder.SetInsertPoint(checkBlock);
-  PHINode *p = builder.CreatePHI(stackItemPointerType, 2, "phi");
-  p -> addIncoming(TheStack, entry);
-  StackItem currentItem = buildGetStackItem(p);
-  p -> addIncoming(currentItem.ptr, unfinishedBlock);
-  Value *cond = builder.CreateIsNull(currentItem.ptr, "isItemNull");
+  PHINode *p = builder.CreatePHI(doublePointerTy, 2, "phi");
+  p -> addIncoming(top, entry);
+  Value *cond = builder.CreateICmpEQ(p, bottom, "isStackDone");
   builder.CreateCondBr(cond, finishedBlock, unfinishedBlock);
   
   builder.SetInsertPoint(unfinishedBlock);
-  buildPrintDouble(currentItem.val);
+  buildPrintDouble(builder.CreateLoad(p, "val"));
+  p -> addIncoming(builder.CreateConstGEP1_32(p, 1, "next"), unfinishedBlock);
   builder.CreateBr(checkBlock);
 
   builder.SetInsertPoint(finishedBlock); 
   builder.CreateRetVoid();
   // dotS definition ends here
 
-  words["+"] = add;
-  words["-"] = sub;
-  words["*"] = mul;
-  words["/"] = divi;
-
-  words["negate"] = negate;
+  // Clocks and counters, for timing code from inside RPN
+  buildFunction("ticks");
+  builder.CreateCall(push, buildTicks());
+  builder.CreateRetVoid();
 
-  words["<"] = lt;
-  words[">"] = gt;
-  words["="] = eq;
-  
-  words["dup"] = dup;
-  words["swap"] = swa;
-  words["drop"] = drop;
-  words["over"] = over;
-  words["nip"] = nip;
-  words["tuck"] = tuck;
-  words["rot"] = rot;
+  buildFunction("usecs");
+  builder.CreateCall(push, buildUsecs());
+  builder.CreateRetVoid();
 
-  words["."] = dot;
-  words[".s"] = dotS;
+#ifdef __linux__
+  buildCounterWord("instructions", PERF_COUNT_HW_INSTRUCTIONS);
+  buildCounterWord("cacheMisses", PERF_COUNT_HW_CACHE_MISSES);
+#endif
 
 }
 
+struct BuiltIn {
+  const char *word;
+  const char *function;  // the function that implements it
+  int inputs, outputs;  // its stack effect, or -1 inputs if that isn't static
+  bool pure;  // false for words that print or read clocks and counters
+};
 
-////////////////////
-// Top level loops
-////////////////////
-
-void JITASTNode(WordAST *node) {  // very simple way to JIT execute a single word
-  Function *F = buildFunction("");  // create anonymous function to run the current word
-  node -> codeGen();
-  builder.CreateRetVoid();
-  void *FPtr = TheExecutionEngine->getPointerToFunction(F);
-  void (*FP)() = (void (*)())FPtr;  // from Kaleidoscope - look into how this works
-  FP();
-  TheExecutionEngine -> freeMachineCodeForFunction(F);
-}
-
-int mainLoop(bool JITMode) {
+static const BuiltIn builtIns[] = {
+  { "+", "add", 2, 1, true },
+  { "-", "sub", 2, 1, true },
+  { "*", "mul", 2, 1, true },
+  { "/", "div", 2, 1, true },
+
+  { "negate", "negate", 1, 1, true },
+
+  { "<", "lt", 2, 1, true },
+  { ">", "gt", 2, 1, true },
+  { "=", "eq", 2, 1, true },
+
+  { "dup", "dup", 1, 2, true },
+  { "swap", "swap", 2, 2, true },
+  { "drop", "drop", 1, 0, true },
+  { "over", "over", 2, 3, true },
+  { "nip", "nip", 2, 1, true },
+  { "tuck", "tuck", 2, 3, true },
+  { "rot", "rot", 3, 3, true },
+
+  { ".", "dot", 1, 0, false },
+  { ".s", "dotS", -1, 0, false },
+
+  { "ticks", "ticks", 0, 1, false },
+  { "usecs", "usecs", 0, 1, false },
+#ifdef __linux__
+  { "instructions", "instructions", 0, 1, false },
+  { "cache-misses", "cacheMisses", 0, 1, false }
+#endif
+};
 
-  WordAST *nextASTNode;
-  
-  while (true) {
-    if (JITMode) showPrompt = true;  // ick
-    getNextToken();
-    showPrompt = false;  // ick
-    
-    try {
-      nextASTNode = parseToken(curTok);
-      if (nextASTNode == 0) return 0;  // EOF
-      if (JITMode) {
-        JITASTNode(nextASTNode);
-      } else {
-        nextASTNode -> codeGen();
-      }
-    } catch (CompilerException e) {  // TODO: Use more meaningful types than std::string or char const
-      std::cout << e.what() << "\n";
-      if (!JITMode) {
-        // If we're compiling a file, we want to stop here because we ran into an error
-        return 1;  
+static void useBuiltInEffect(Word *word) {
+  // Fill in the stack effect and purity of a word without a definition, going by the function that 
+  // implements it
+
+  word -> effect = EFFECT_DYNAMIC;
+  word -> pure = false;
+  for (unsigned idx = 0; idx < sizeof(builtIns) / sizeof(builtIns[0]); ++idx) {
+    if (word -> function -> getName() == builtIns[idx].function) {
+      if (builtIns[idx].inputs >= 0) {
+        word -> effect = EFFECT_STATIC;
+        word -> inputs = builtIns[idx].inputs;
+        word -> outputs = builtIns[idx].outputs;
       }
+      word -> pure = builtIns[idx].pure;
     }
   }
 
 }
 
-int main(int argc, char *argv[]) {
-  
-  bool JITMode;
-
-  std::ifstream fs;  // the filestream to open if we need one
+void registerBuiltIns() {
+  // Put the built-in words in the dictionary
 
-  if (argc == 1) {  // if no file, then we just read stdin in JITMode
-    JITMode = true;
-    inputStream = &std::cin;
-  } else if (argc == 2) {  // otherwise open the file we got on the command line
-    JITMode = false;
-    fs.open(argv[1]);
-    if (!fs.is_open()) {
-      std::cout << "Couldn't open file \"" << argv[1] << "\"\n";
-      return 1;
+  for (unsigned idx = 0; idx < sizeof(builtIns) / sizeof(builtIns[0]); ++idx) {
+    Word *word = new Word(builtIns[idx].word);
+    word -> function = theModule -> getFunction(builtIns[idx].function);
+    if (!word -> function) {  // loadRuntime's version check should have caught this
+      fprintf(stderr, "The runtime has no code for the built-in word \"%s\" - regenerate runtime.inc\n", builtIns[idx].word);
+      exit(1);
     }
-    inputStream = &fs;  // point inputStream to our file so other functions can use it
-  } else {
-    std::cout << "usage: rpn [filename]\n";
-    return 1;
+    useBuiltInEffect(word);
+    ++word -> users;
+    words[word -> name] = word;
   }
 
-  InitializeNativeTarget(); 
+}
+
+// Saved runtimes (see loadRuntime) record the version of the built-ins they hold. Bump this whenever
+// the built-ins or the stack change.
+static const unsigned runtimeVersion = 1;
 
-  // Set up useful types
-  // TODO: Maybe declare other types here to shorten the function declarations
-  stackItemType = StructType::create(getGlobalContext());  // create opaque structure to forward declare it
-  stackItemPointerType = PointerType::get(stackItemType, 0);  // so this and the next line can refer to each other
-  stackItemType -> setBody(Type::getDoubleTy(getGlobalContext()), stackItemPointerType, NULL);
+void buildRuntime() {
+  // Generate the stack and the built-in words from scratch
 
-  // Our global stack
-  TheStack = (GlobalVariable*)(theModule -> getOrInsertGlobal("thestack", stackItemType));
-  TheStack -> setInitializer(Constant::getNullValue(stackItemType));
+  new GlobalVariable(*theModule, int32Ty, true, GlobalValue::ExternalLinkage, 
+    ConstantInt::get(int32Ty, runtimeVersion), "runtimeversion");
 
-  DataLayout dl = DataLayout("");
-  stackItemSize = dl.getTypeAllocSize(stackItemType);
+  // Our global stack. Where it lives is only decided when the program starts.
+  TheStack = (GlobalVariable*)(theModule -> getOrInsertGlobal("thestack", doublePointerTy));
+  TheStack -> setInitializer(Constant::getNullValue(doublePointerTy));
+  TheStackBottom = (GlobalVariable*)(theModule -> getOrInsertGlobal("stackbottom", doublePointerTy));
+  TheStackBottom -> setInitializer(Constant::getNullValue(doublePointerTy));
 
   codeGenBuiltIns();
 
-  if (JITMode) {
-    // if we're JITing, we need to set up an execution engine
-    
-    std::string ErrStr;
-    TheExecutionEngine = EngineBuilder(theModule).setErrorStr(&ErrStr).create();
-    
-    if (!TheExecutionEngine) {
-      fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
-      exit(1);
-    }
+}
 
-    std::cout << "Welcome to rpn!\n";
+void optimizeRuntime() {
+  // Clean up the built-ins' code before saving it (see emitRuntime)
 
-    mainLoop(JITMode);
+  FunctionPassManager fpm(theModule);
+  fpm.add(createInstructionCombiningPass());
+  fpm.add(createGVNPass());
+  fpm.add(createCFGSimplificationPass());
 
-  } else {
-    // if we're not JITing, then we need to wrap our generated code in a main function
-    
-    FunctionType *mainType = FunctionType::get(int32Ty, false);
-    Function *mainFunction = Function::Create(mainType, Function::ExternalLinkage, "main", theModule);
-    BasicBlock *mainEntry = BasicBlock::Create(getGlobalContext(), "entry", mainFunction);
-    builder.SetInsertPoint(mainEntry);
+  fpm.doInitialization();
+  for (Module::iterator f = theModule -> begin(); f != theModule -> end(); ++f) {
+    if (!f -> isDeclaration()) fpm.run(*f);
+  }
+  fpm.doFinalization();
 
-    if (mainLoop(JITMode) == 1) return 1;
-    
-    if (fs.is_open()) fs.close();
+}
+
+void useRuntimeModule(Module *runtime);
+
+#ifdef RPN_EMBEDDED_RUNTIME
+
+void loadRuntime() {
+  // Use the built-ins compiled into the executable instead of generating them. Function bodies are
+  // only read from the bitcode when something needs them.
+
+  MemoryBuffer *buffer = MemoryBuffer::getMemBuffer(StringRef((const char *)runtime_bc, runtime_bc_len), "runtime", false);
+  std::string error;
+  Module *runtime = getLazyBitcodeModule(buffer, getGlobalContext(), &error);
+  if (!runtime) {
+    fprintf(stderr, "Could not load the built-in runtime: %s\n", error.c_str());
+    exit(1);
+  }
+
+  GlobalVariable *version = runtime -> getNamedGlobal("runtimeversion");
+  ConstantInt *versionValue = version ? dyn_cast_or_null<ConstantInt>(version -> getInitializer()) : 0;
+  if (!versionValue || versionValue -> getZExtValue() != runtimeVersion) {
+    fprintf(stderr, "The built-in runtime is out of date - regenerate runtime.inc and rebuild rpn\n");
+    exit(1);
+  }
+  useRuntimeModule(runtime);
+
+}
+
+#endif
+
+void useRuntimeModule(Module *runtime) {
+  // Switch to a module (from bitcode) that already has the stack and built-ins in it
+
+  delete theModule;
+  theModule = runtime;
+
+  TheStack = theModule -> getNamedGlobal("thestack");
+  TheStackBottom = theModule -> getNamedGlobal("stackbottom");
+
+  printf_ = theModule -> getFunction("printf");
+  push = theModule -> getFunction("push");
+  pop = theModule -> getFunction("pop");
+  fstring = builder.CreateConstInBoundsGEP2_32(theModule -> getNamedGlobal("fstring"), 0, 0);  // folds to a constant
+
+}
+
+Function *buildNativeWrapper(Function *word) {
+  // Generate a function callable from C as a NativeWord (see rpn.h). It pushes its inputs, calls word,
+  // then pops the whole stack, copying as many results as fit into the output array.
+
+  Type *params[] = { doublePointerTy, int64Ty, doublePointerTy, int64Ty };
+  FunctionType *t = FunctionType::get(int64Ty, params, false);
+  Function *f = Function::Create(t, Function::ExternalLinkage, word -> getName() + ".native", theModule);
+
+  Function::arg_iterator args = f -> arg_begin();
+  Value *in = args++;
+  Value *nIn = args++;
+  Value *out = args++;
+  Value *maxOut = args;
+  in -> setName("in");
+  nIn -> setName("nIn");
+  out -> setName("out");
+  maxOut -> setName("maxOut");
+
+  BasicBlock *entry = BasicBlock::Create(getGlobalContext(), "entry", f);
+  BasicBlock *pushCheck = BasicBlock::Create(getGlobalContext(), "pushCheck", f);
+  BasicBlock *pushBlock = BasicBlock::Create(getGlobalContext(), "pushInput", f);
+  BasicBlock *callBlock = BasicBlock::Create(getGlobalContext(), "call", f);
+  BasicBlock *popCheck = BasicBlock::Create(getGlobalContext(), "popCheck", f);
+  BasicBlock *popBlock = BasicBlock::Create(getGlobalContext(), "popResult", f);
+  BasicBlock *storeBlock = BasicBlock::Create(getGlobalContext(), "storeResult", f);
+  BasicBlock *finishedBlock = BasicBlock::Create(getGlobalContext(), "finished", f);
+
+  builder.SetInsertPoint(entry);
+  builder.CreateBr(pushCheck);
+
+  // Push in[0] through in[nIn - 1]
+  builder.SetInsertPoint(pushCheck);
+  PHINode *i = builder.CreatePHI(int64Ty, 2, "i");
+  i -> addIncoming(getInt64(0), entry);
+  builder.CreateCondBr(builder.CreateICmpULT(i, nIn), pushBlock, callBlock);
+
+  builder.SetInsertPoint(pushBlock);
+  builder.CreateCall(push, builder.CreateLoad(builder.CreateGEP(in, i), "input"));
+  i -> addIncoming(builder.CreateAdd(i, getInt64(1)), pushBlock);
+  builder.CreateBr(pushCheck);
+
+  builder.SetInsertPoint(callBlock);
+  builder.CreateCall(word);
+  builder.CreateBr(popCheck);
+
+  // Pop until the stack is empty, keeping the first maxOut results
+  builder.SetInsertPoint(popCheck);
+  PHINode *n = builder.CreatePHI(int64Ty, 3, "resultCount");
+  n -> addIncoming(getInt64(0), callBlock);
+  Value *isEmpty = builder.CreateICmpEQ(builder.CreateLoad(TheStack), builder.CreateLoad(TheStackBottom), "isStackEmpty");
+  builder.CreateCondBr(isEmpty, finishedBlock, popBlock);
+
+  builder.SetInsertPoint(popBlock);
+  Value *result = builder.CreateCall(pop, "result");
+  n -> addIncoming(n, popBlock);
+  builder.CreateCondBr(builder.CreateICmpULT(n, maxOut), storeBlock, popCheck);
+
+  builder.SetInsertPoint(storeBlock);
+  builder.CreateStore(result, builder.CreateGEP(out, n));
+  n -> addIncoming(builder.CreateAdd(n, getInt64(1)), storeBlock);
+  builder.CreateBr(popCheck);
+
+  builder.SetInsertPoint(finishedBlock);
+  builder.CreateRet(n);
+
+  verifyFunction(*f);
+
+  return f;
+
+}
+
+
+////////////////////
+// Stack effects
+////////////////////
+
+// When a word always takes the same number of items from the stack and leaves the same number in 
+// their place, we compile it with its inputs as parameters and its outputs as return values (its 
+// "register function"), keeping the stack contents in virtualStack while generating the code. Calls 
+// between such words, and the built-ins inside them, then never touch the memory stack. The word's 
+// plain function just moves items between the two, for callers that don't know the effect.
+
+static const int maxRecursiveEffect = 8;  // most inputs or outputs we'll try for a recursive word
+
+static Word *inferring = 0;  // the word inferStackEffect is working on
+static bool assumedEffectUsed;  // whether it called itself, using the effect we guessed for it
+
+bool addMultipleStackEffects(std::vector<WordAST *> content, StackEffect &effect) {
+  for (unsigned idx = 0; idx < content.size(); ++idx) {
+    if (!content.at(idx) -> addStackEffect(effect)) return false;
+  }
+  return true;
+}
+
+static bool addWordStackEffect(Word *word, StackEffect &effect) {
+  if (word == inferring) assumedEffectUsed = true;  // a recursive call, so use our guess
+  else if (!inferStackEffect(word)) return false;
+  effect.apply(word -> inputs, word -> outputs);
+  return true;
+}
+
+static bool findStackEffect(Word *word) {
+  // Without recursion, going through the definition once gives the effect. A recursive word's effect
+  // depends on itself, so we look for one that's consistent: if the recursive calls have it, so 
+  // does the whole word.
+
+  StackEffect effect;
+  word -> inputs = word -> outputs = 0;
+  assumedEffectUsed = false;
+  bool found = word -> definition -> addBodyStackEffect(effect);
+  if (!assumedEffectUsed) {
+    word -> inputs = effect.inputs();
+    word -> outputs = effect.outputs();
+    return found;
+  }
+
+  for (int in = 0; in <= maxRecursiveEffect; ++in) {
+    for (int out = 0; out <= maxRecursiveEffect; ++out) {
+      StackEffect candidate;
+      word -> inputs = in;
+      word -> outputs = out;
+      if (word -> definition -> addBodyStackEffect(candidate) && candidate.inputs() == in && candidate.outputs() == out) {
+        return true;
+      }
+    }
+  }
+  return false;
+
+}
+
+bool inferStackEffect(Word *word) {
+  // Work out whether word's stack effect is static, filling in its inputs and outputs if so. Only 
+  // for use in compiler jobs.
+
+  if (word -> effect == EFFECT_UNKNOWN && word -> definition) {
+    Word *outerWord = inferring;  // a definition inside another one gets worked out in the middle
+    bool outerUsed = assumedEffectUsed;
+    inferring = word;
+    word -> effect = EFFECT_INFERRING;
+    word -> effect = findStackEffect(word) ? EFFECT_STATIC : EFFECT_DYNAMIC;
+    inferring = outerWord;
+    assumedEffectUsed = outerUsed;
+  }
+  return word -> effect == EFFECT_STATIC;  // a word still being inferred counts as dynamic
+
+}
+
+bool BasicWordAST::addStackEffect(StackEffect &effect) {
+  return addWordStackEffect(word, effect);
+}
+
+bool NumberAST::addStackEffect(StackEffect &effect) {
+  effect.apply(0, 1);
+  return true;
+}
+
+bool IfAST::addStackEffect(StackEffect &effect) {
+  // Both branches have to use the same number of items and leave the stack the same size. Otherwise
+  // a register word would take the items the deeper branch needs even when the other one runs, and
+  // underflow where the stack version wouldn't.
+
+  effect.apply(1, 0);
+  StackEffect thenEffect = effect;
+  StackEffect elseEffect = effect;
+  if (!addMultipleStackEffects(thenContent, thenEffect) || !addMultipleStackEffects(elseContent, elseEffect)) return false;
+  if (thenEffect.depth != elseEffect.depth || thenEffect.lowest != elseEffect.lowest) return false;
+
+  effect = thenEffect;
+  return true;
+
+}
+
+// Loops can run any number of times
+bool BeginAST::addStackEffect(StackEffect &effect) { return false; }
+bool AgainAST::addStackEffect(StackEffect &effect) { return false; }
+bool WhileAST::addStackEffect(StackEffect &effect) { return false; }
+
+bool DefinitionAST::addStackEffect(StackEffect &effect) { return true; }  // nothing happens at run time
+
+bool DefinitionAST::addBodyStackEffect(StackEffect &effect) {
+  effect.apply(locals.size(), 0);
+  return addMultipleStackEffects(content, effect);
+}
+
+bool LocalRefAST::addStackEffect(StackEffect &effect) {
+  effect.apply(0, 1);
+  return true;
+}
+
+bool RecurseAST::addStackEffect(StackEffect &effect) {
+  return inferring && addWordStackEffect(inferring, effect);
+}
+
+bool CommentAST::addStackEffect(StackEffect &effect) { return true; }
+
+bool ImageAST::addStackEffect(StackEffect &effect) { return false; }
+
+
+////////////////////
+// Register code
+////////////////////
+
+void registerCodeGenMultiple(std::vector<WordAST *> content) {
+  for (unsigned idx = 0; idx < content.size(); ++idx) {
+    content.at(idx) -> registerCodeGen();
+  }
+}
+
+static Value *popRegister() {
+  Value *top = virtualStack.back();
+  virtualStack.pop_back();
+  return top;
+}
+
+static void buildRegisterCall(Function *f) {
+  // Call a register function with the items it takes from the top of virtualStack, and put its 
+  // results in their place
+
+  unsigned inputs = f -> arg_size();
+  std::vector<Value *> args(virtualStack.end() - inputs, virtualStack.end());
+  virtualStack.resize(virtualStack.size() - inputs);
+
+  Value *result = builder.CreateCall(f, args);
+  Type *resultType = f -> getReturnType();
+  if (resultType -> isDoubleTy()) {
+    virtualStack.push_back(result);
+  } else if (resultType -> isStructTy()) {
+    for (unsigned idx = 0; idx < resultType -> getStructNumElements(); ++idx) {
+      virtualStack.push_back(builder.CreateExtractValue(result, idx));
+    }
+  }
+
+}
+
+static Value *buildFlag(Value *cond) {
+  // Forth "true" results are -1
+  return builder.CreateFMul(builder.CreateUIToFP(cond, doubleTy), getDouble(-1.0));
+}
+
+static void buildRegisterBuiltIn(std::string function) {
+  // Do what the built-in implemented by function does (see codeGenBuiltIns), but to virtualStack
+
+  std::vector<Value *> &s = virtualStack;
+
+  if (function == "dup") {
+    s.push_back(s.back());
+  } else if (function == "swap") {
+    std::swap(s[s.size() - 1], s[s.size() - 2]);
+  } else if (function == "drop") {
+    s.pop_back();
+  } else if (function == "over") {
+    s.push_back(s[s.size() - 2]);
+  } else if (function == "nip") {
+    s.erase(s.end() - 2);
+  } else if (function == "tuck") {
+    s.insert(s.end() - 2, s.back());
+  } else if (function == "rot") {
+    std::rotate(s.end() - 3, s.end() - 2, s.end());
+  } else if (function == "negate") {
+    s.back() = builder.CreateFNeg(s.back(), "negtmp");
+  } else if (function == "dot") {
+    buildPrintDouble(popRegister());
+  } else if (function == "ticks") {
+    s.push_back(buildTicks());
+  } else if (function == "usecs" || function == "instructions" || function == "cacheMisses") {
+    // These need memory of their own, so leave them to the stack version
+    builder.CreateCall(theModule -> getFunction(function));
+    s.push_back(builder.CreateCall(pop, "reading"));
+  } else {
+    Value *a = popRegister();
+    Value *b = popRegister();
+    Value *result;
+    if (function == "add") result = builder.CreateFAdd(a, b, "addtmp");
+    else if (function == "sub") result = builder.CreateFSub(b, a, "subtmp");
+    else if (function == "mul") result = builder.CreateFMul(b, a, "multmp");
+    else if (function == "div") result = builder.CreateFDiv(b, a, "divtmp");
+    else if (function == "lt") result = buildFlag(builder.CreateFCmpULT(b, a, "lttmp"));
+    else if (function == "gt") result = buildFlag(builder.CreateFCmpUGT(b, a, "gttmp"));
+    else if (function == "eq") result = buildFlag(builder.CreateFCmpOEQ(b, a, "eqtmp"));
+    else throw CompilerException("no register code for built-in " + function);
+    s.push_back(result);
+  }
+
+}
+
+static void buildRegisterReturn(std::vector<Value *> results) {
+  // Return results from the register function we're generating code for
+
+  Type *resultType = builder.GetInsertBlock() -> getParent() -> getReturnType();
+  if (results.size() == 0) {
+    builder.CreateRetVoid();
+  } else if (results.size() == 1) {
+    builder.CreateRet(results[0]);
+  } else {
+    Value *result = UndefValue::get(resultType);
+    for (unsigned idx = 0; idx < results.size(); ++idx) {
+      result = builder.CreateInsertValue(result, results[idx], idx);
+    }
+    builder.CreateRet(result);
+  }
+
+}
+
+Value *buildMemoLookup(Word *word);
+void buildMemoStore(Value *cacheEntry, std::vector<Value *> inputs, std::vector<Value *> outputs);
+
+void DefinitionAST::buildRegisterWord() {
+  // Generate word's register function, and the function that wraps it for memory stack callers. 
+  // Locals are plain values here, so they don't need allocas.
+
+  std::vector<Type *> params(word -> inputs, doubleTy);
+  Type *resultType;
+  if (word -> outputs == 0) resultType = voidTy;
+  else if (word -> outputs == 1) resultType = doubleTy;
+  else resultType = StructType::get(getGlobalContext(), std::vector<Type *>(word -> outputs, doubleTy));
+
+  FunctionType *t = FunctionType::get(resultType, params, false);
+  Function *r = Function::Create(t, Function::ExternalLinkage, word -> name + ".regs", theModule);
+  word -> registerFunction = r;
+
+  // The wrapper pops the inputs (top first) and pushes the results (bottom first)
+  word -> function = buildFunction(word -> name);
+  virtualStack = buildPopX(word -> inputs);
+  std::reverse(virtualStack.begin(), virtualStack.end());
+  buildRegisterCall(r);
+  for (unsigned idx = 0; idx < virtualStack.size(); ++idx) builder.CreateCall(push, virtualStack[idx]);
+  builder.CreateRetVoid();
+  verifyFunction(*word -> function);
+
+  BasicBlock *entry = BasicBlock::Create(getGlobalContext(), "entry", r);
+  builder.SetInsertPoint(entry);
+  virtualStack.clear();
+  for (Function::arg_iterator arg = r -> arg_begin(); arg != r -> arg_end(); ++arg) virtualStack.push_back(arg);
+
+  std::vector<Value *> inputs = virtualStack;
+  Value *cacheEntry = memo ? buildMemoLookup(word) : 0;
+
+  currentLocals.resize(locals.size());
+  for (unsigned idx = locals.size(); idx > 0; --idx) {  // the rightmost local gets the top of the stack
+    currentLocals[idx - 1] = popRegister();
+  }
+
+  registerCodeGenMultiple(content);
+
+  // Inference guarantees exactly word -> outputs items are left
+  if (cacheEntry) buildMemoStore(cacheEntry, inputs, virtualStack);
+  buildRegisterReturn(virtualStack);
+
+  verifyFunction(*r);
+
+}
+
+void BasicWordAST::registerCodeGen() {
+  if (word -> definition) {
+    compileWord(word);
+    buildRegisterCall(word -> registerFunction);
+  } else {
+    buildRegisterBuiltIn(word -> function -> getName().str());
+  }
+}
+
+void NumberAST::registerCodeGen() {
+  virtualStack.push_back(getDouble(val));
+}
+
+void IfAST::registerCodeGen() {
+  // Each branch works on its own copy of virtualStack. Wherever they end up with different values, 
+  // the merge block gets a phi.
+
+  Value *cond = builder.CreateFCmpONE(popRegister(), getDouble(0.0), "ifCond");
+  Function *currentFunction = builder.GetInsertBlock() -> getParent();
+
+  BasicBlock *thenBB = BasicBlock::Create(getGlobalContext(), "then", currentFunction);
+  BasicBlock *elseBB = BasicBlock::Create(getGlobalContext(), "else", currentFunction);
+  BasicBlock *mergeBB = BasicBlock::Create(getGlobalContext(), "merge", currentFunction);
+  builder.CreateCondBr(cond, thenBB, elseBB);
+
+  std::vector<Value *> startStack = virtualStack;
+
+  builder.SetInsertPoint(thenBB);
+  registerCodeGenMultiple(thenContent);
+  builder.CreateBr(mergeBB);
+  BasicBlock *thenEnd = builder.GetInsertBlock();
+  std::vector<Value *> thenStack = virtualStack;
+  virtualStack = startStack;
+
+  builder.SetInsertPoint(elseBB);
+  registerCodeGenMultiple(elseContent);
+  builder.CreateBr(mergeBB);
+  BasicBlock *elseEnd = builder.GetInsertBlock();
+
+  builder.SetInsertPoint(mergeBB);
+  for (unsigned idx = 0; idx < virtualStack.size(); ++idx) {
+    if (thenStack[idx] == virtualStack[idx]) continue;
+    PHINode *p = builder.CreatePHI(doubleTy, 2, "ifResult");
+    p -> addIncoming(thenStack[idx], thenEnd);
+    p -> addIncoming(virtualStack[idx], elseEnd);
+    virtualStack[idx] = p;
+  }
+
+}
+
+// Words with loops never get register functions (see BeginAST::addStackEffect)
+void BeginAST::registerCodeGen() { throw CompilerException("begin has no static stack effect"); }
+void AgainAST::registerCodeGen() { throw CompilerException("again has no static stack effect"); }
+void WhileAST::registerCodeGen() { throw CompilerException("while has no static stack effect"); }
+
+void DefinitionAST::registerCodeGen() { codeGen(); }
+
+void LocalRefAST::registerCodeGen() {
+  virtualStack.push_back(currentLocals[index]);
+}
+
+void RecurseAST::registerCodeGen() {
+  buildRegisterCall(builder.GetInsertBlock() -> getParent());
+}
+
+void CommentAST::registerCodeGen() {}
+
+void ImageAST::registerCodeGen() { codeGen(); }
+
+
+////////////////////
+// Memoization
+////////////////////
+
+// A memo word's register function starts by looking its inputs up in a cache, and returns the 
+// results stored there if it finds them. Otherwise it runs as usual and stores its results before
+// returning. Each memo word has its own direct-mapped cache of memoCacheSize entries, so the cache
+// never grows - a new result just replaces whatever was in its entry. Words only cache results once
+// they're compiled, and only if their stack effect is static.
+
+static const unsigned memoCacheSize = 4096;  // must be a power of 2
+
+std::future<void> queueCompilerJob(std::function<void()> job, bool urgent);
+
+static Value *getInt64Bits(uint64_t x) {
+  return ConstantInt::get(int64Ty, x);
+}
+
+static void buildIncrement(Value *counter) {
+  builder.CreateStore(builder.CreateAdd(builder.CreateLoad(counter), getInt64Bits(1)), counter);
+}
+
+Value *buildMemoLookup(Word *word) {
+  // Generate the lookup at the start of word's register function, with its inputs in virtualStack.
+  // Leaves builder where the results need computing, and returns the address of the cache entry.
+  // Inputs are compared bit for bit, so NaNs and negative zero work as keys too.
+
+  Function *r = word -> registerFunction;
+
+  Type *fields[] = { int8Ty, ArrayType::get(doubleTy, word -> inputs), ArrayType::get(doubleTy, word -> outputs) };
+  StructType *entryTy = StructType::get(getGlobalContext(), fields);  // filled flag, inputs, results
+  ArrayType *cacheTy = ArrayType::get(entryTy, memoCacheSize);
+  GlobalVariable *cache = new GlobalVariable(*theModule, cacheTy, false, GlobalValue::ExternalLinkage, 
+    ConstantAggregateZero::get(cacheTy), word -> name + ".cache");
+  word -> memoCache = cache;
+  ArrayType *statsTy = ArrayType::get(int64Ty, 2);
+  word -> memoStats = new GlobalVariable(*theModule, statsTy, false, GlobalValue::ExternalLinkage, 
+    ConstantAggregateZero::get(statsTy), word -> name + ".stats");  // hits, then misses
+
+  if (TheExecutionEngine) {
+    // The JIT never frees the memory it allocates for globals, so give it some that retireWord can
+    const DataLayout *layout = TheExecutionEngine -> getDataLayout();
+    uint64_t cacheSize = layout -> getTypeAllocSize(cacheTy);
+    word -> memoMemory = calloc(1, cacheSize + layout -> getTypeAllocSize(statsTy));
+    if (!word -> memoMemory) throw CompilerException("out of memory for " + word -> name + "'s cache");
+    TheExecutionEngine -> addGlobalMapping(word -> memoCache, word -> memoMemory);
+    TheExecutionEngine -> addGlobalMapping(word -> memoStats, (char *)word -> memoMemory + cacheSize);
+  }
+
+  // FNV-1a style hash of the inputs' bits
+  std::vector<Value *> keys;
+  Value *hash = getInt64Bits(14695981039346656037ULL);
+  for (unsigned idx = 0; idx < virtualStack.size(); ++idx) {
+    keys.push_back(builder.CreateBitCast(virtualStack[idx], int64Ty, "key"));
+    hash = builder.CreateMul(builder.CreateXor(hash, keys[idx]), getInt64Bits(1099511628211ULL));
+  }
+  hash = builder.CreateXor(hash, builder.CreateLShr(hash, 32));
+  Value *index = builder.CreateAnd(hash, memoCacheSize - 1, "cacheIndex");
+
+  Value *entryIdx[] = { getInt64(0), index };
+  Value *entry = builder.CreateInBoundsGEP(cache, entryIdx, "cacheEntry");
+
+  Value *hit = builder.CreateICmpNE(builder.CreateLoad(builder.CreateStructGEP(entry, 0)), getInt8(0));
+  for (unsigned idx = 0; idx < keys.size(); ++idx) {
+    Value *keyIdx[] = { getInt32(0), getInt32(1), getInt32(idx) };
+    Value *cached = builder.CreateBitCast(builder.CreateLoad(builder.CreateInBoundsGEP(entry, keyIdx)), int64Ty);
+    hit = builder.CreateAnd(hit, builder.CreateICmpEQ(cached, keys[idx]));
+  }
+
+  BasicBlock *hitBB = BasicBlock::Create(getGlobalContext(), "cacheHit", r);
+  BasicBlock *missBB = BasicBlock::Create(getGlobalContext(), "cacheMiss", r);
+  builder.CreateCondBr(hit, hitBB, missBB);
+
+  builder.SetInsertPoint(hitBB);
+  buildIncrement(builder.CreateConstInBoundsGEP2_32(word -> memoStats, 0, 0));
+  std::vector<Value *> results;
+  for (int idx = 0; idx < word -> outputs; ++idx) {
+    Value *resultIdx[] = { getInt32(0), getInt32(2), getInt32(idx) };
+    results.push_back(builder.CreateLoad(builder.CreateInBoundsGEP(entry, resultIdx), "cachedResult"));
+  }
+  buildRegisterReturn(results);
+
+  builder.SetInsertPoint(missBB);
+  buildIncrement(builder.CreateConstInBoundsGEP2_32(word -> memoStats, 0, 1));
+
+  return entry;
+
+}
+
+void buildMemoStore(Value *cacheEntry, std::vector<Value *> inputs, std::vector<Value *> outputs) {
+  // Generate code to save a memo word's results in its cache entry before returning them
+
+  builder.CreateStore(getInt8(1), builder.CreateStructGEP(cacheEntry, 0));
+  for (unsigned idx = 0; idx < inputs.size(); ++idx) {
+    Value *keyIdx[] = { getInt32(0), getInt32(1), getInt32(idx) };
+    builder.CreateStore(inputs[idx], builder.CreateInBoundsGEP(cacheEntry, keyIdx));
+  }
+  for (unsigned idx = 0; idx < outputs.size(); ++idx) {
+    Value *resultIdx[] = { getInt32(0), getInt32(2), getInt32(idx) };
+    builder.CreateStore(outputs[idx], builder.CreateInBoundsGEP(cacheEntry, resultIdx));
+  }
+
+}
+
+void MemoStatsAST::codeGen() {
+  // Compiled code prints the counters straight from the caches' globals
+
+  for (unsigned idx = 0; idx < statsWords.size(); ++idx) {
+    Word *word = statsWords[idx];
+    compileWord(word);
+    Value *name = builder.CreateGlobalStringPtr(word -> name, "memoName");
+    if (word -> memoStats) {
+      Value *format = builder.CreateGlobalStringPtr("%s: %lld hits, %lld misses\n", "memoFormat");
+      Value *hits = builder.CreateLoad(builder.CreateConstInBoundsGEP2_32(word -> memoStats, 0, 0), "hits");
+      Value *misses = builder.CreateLoad(builder.CreateConstInBoundsGEP2_32(word -> memoStats, 0, 1), "misses");
+      Value *args[] = { format, name, hits, misses };
+      builder.CreateCall(printf_, args);
+    } else {
+      Value *format = builder.CreateGlobalStringPtr("%s: not cached (its stack effect isn't static)\n", "memoFormat");
+      builder.CreateCall2(printf_, format, name);
+    }
+  }
+
+}
+
+void MemoStatsAST::threadCode(std::vector<ThreadedOp> &code) {
+  code[emitOp(code, OP_MEMO_STATS)].stats = this;
+}
+
+bool MemoStatsAST::addStackEffect(StackEffect &effect) { return true; }  // prints, but leaves the stack alone
+
+void MemoStatsAST::registerCodeGen() { codeGen(); }
+
+void MemoStatsAST::run() {
+  // The interpreter reads the counters on the compiler thread, which owns the JIT
+
+  std::vector<std::string> lines(statsWords.size());
+  queueCompilerJob([this, &lines]() {
+    for (unsigned idx = 0; idx < statsWords.size(); ++idx) {
+      Word *word = statsWords[idx];
+      std::ostringstream line;
+      line << word -> name << ": ";
+      if (!word -> native) {
+        line << "not compiled yet";
+      } else if (!word -> memoStats) {
+        line << "not cached (its stack effect isn't static)";
+      } else {
+        uint64_t *stats = (uint64_t *)TheExecutionEngine -> getPointerToGlobal(word -> memoStats);
+        line << stats[0] << " hits, " << stats[1] << " misses";
+      }
+      lines[idx] = line.str();
+    }
+  }, true).wait();
+
+  for (unsigned idx = 0; idx < lines.size(); ++idx) std::cout << lines[idx] << "\n";
+
+}
+
+
+////////////////////
+// Stack memory
+////////////////////
+
+// The stack gets a mapping of its own, with an inaccessible guard area at either end. Underflowing 
+// or overflowing the stack touches one of them, and the fault is turned into an error message - in
+// the REPL by stackFaultHandler, which gets back to the REPL with siglongjmp, and in compiled 
+// programs by a handler that buildStackSetup generates. So stack operations never check anything.
+
+#ifdef RPN_UNCHECKED_STACK
+static const size_t stackGuardSize = 0;  // no guard areas, for comparison (see examples/stack-benchmark.rpn)
+#else
+static const size_t stackGuardSize = 1 << 16;  // a multiple of any likely page size
+#endif
+static const size_t stackRegionSize = (1 << 23) + 2 * stackGuardSize;  // room for about a million items
+
+static char *stackRegion;
+static double **stackTopNative;  // the JIT's thestack, so C++ can get at the stack without LLVM
+static double *stackBottomNative;
+
+static sigjmp_buf stackFaultJump;
+static volatile sig_atomic_t catchingStackFaults = 0;  // whether stackFaultJump is set
+
+static void setUpStack() {
+  // Map the stack for the JIT
+
+  stackRegion = (char *)mmap(0, stackRegionSize, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (stackRegion == MAP_FAILED || 
+      mprotect(stackRegion + stackGuardSize, stackRegionSize - 2 * stackGuardSize, PROT_READ | PROT_WRITE) != 0) {
+    perror("Could not map the stack");
+    exit(1);
+  }
+
+  stackBottomNative = (double *)(stackRegion + stackRegionSize - stackGuardSize);
+  stackTopNative = (double **)TheExecutionEngine -> getPointerToGlobal(TheStack);
+  *stackTopNative = stackBottomNative;
+  *(double **)TheExecutionEngine -> getPointerToGlobal(TheStackBottom) = stackBottomNative;
+
+}
+
+static void stackFaultHandler(int sig, siginfo_t *info, void *context) {
+
+  char *address = (char *)info -> si_addr;
+  bool overflow = address >= stackRegion && address < stackRegion + stackGuardSize;  // the stack grows down
+  bool underflow = address >= stackRegion + stackRegionSize - stackGuardSize && address < stackRegion + stackRegionSize;
+
+  if (catchingStackFaults && (overflow || underflow)) {
+    catchingStackFaults = 0;
+    siglongjmp(stackFaultJump, overflow ? 1 : 2);
+  }
+
+  signal(sig, SIG_DFL);  // some other fault, so crash the way we would have anyway
+
+}
+
+void catchStackFaults() {
+  // Report stack faults instead of crashing. The REPL and --map always do this, but a program that
+  // embeds RPN might have its own plans for these signals, so there it's opt in (see rpn.h).
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = stackFaultHandler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, 0);
+  sigaction(SIGBUS, &action, 0);  // what some systems raise for guard pages
+
+}
+
+void buildStackSetup() {
+  // Generate code (for the start of main) that maps the stack and reports faults in its guard areas
+
+  Type *mmapParams[] = { int8PointerTy, int64Ty, int32Ty, int32Ty, int32Ty, int64Ty };
+  Constant *mmap_ = theModule -> getOrInsertFunction("mmap", FunctionType::get(int8PointerTy, mmapParams, false));
+  Type *mprotectParams[] = { int8PointerTy, int64Ty, int32Ty };
+  Constant *mprotect_ = theModule -> getOrInsertFunction("mprotect", FunctionType::get(int32Ty, mprotectParams, false));
+
+  Value *mmapArgs[] = { Constant::getNullValue(int8PointerTy), getInt64(stackRegionSize), getInt32(PROT_NONE), 
+    getInt32(MAP_PRIVATE | MAP_ANON), getInt32(-1), getInt64(0) };
+  Value *region = builder.CreateCall(mmap_, mmapArgs, "stackRegion");
+  Value *protectArgs[] = { builder.CreateConstGEP1_32(region, stackGuardSize), getInt64(stackRegionSize - 2 * stackGuardSize), 
+    getInt32(PROT_READ | PROT_WRITE) };
+  builder.CreateCall(mprotect_, protectArgs);
+
+  Value *bottom = builder.CreateBitCast(builder.CreateConstGEP1_32(region, stackRegionSize - stackGuardSize), doublePointerTy);
+  builder.CreateStore(bottom, TheStack);
+  builder.CreateStore(bottom, TheStackBottom);
+
+  GlobalVariable *regionGlobal = new GlobalVariable(*theModule, int8PointerTy, false, GlobalValue::ExternalLinkage, 
+    Constant::getNullValue(int8PointerTy), "stackregion");
+  builder.CreateStore(region, regionGlobal);
+
+  // Compiled programs just stop when there's a fault in a guard area, since there's nothing to go 
+  // back to. Like stackFaultHandler, the handler goes by the fault address, and any other fault 
+  // crashes the program as usual.
+  BasicBlock *mainBlock = builder.GetInsertBlock();
+  Type *handlerParams[] = { int32Ty, int8PointerTy, int8PointerTy };  // signal, siginfo_t *, context
+  FunctionType *handlerType = FunctionType::get(voidTy, handlerParams, false);
+  Function *handler = Function::Create(handlerType, Function::ExternalLinkage, "stackFault", theModule);
+  Function::arg_iterator args = handler -> arg_begin();
+  Value *sig = args++;
+  Value *info = args;
+  BasicBlock *entry = BasicBlock::Create(getGlobalContext(), "entry", handler);
+  BasicBlock *overflowBlock = BasicBlock::Create(getGlobalContext(), "overflow", handler);
+  BasicBlock *notOverflowBlock = BasicBlock::Create(getGlobalContext(), "notOverflow", handler);
+  BasicBlock *underflowBlock = BasicBlock::Create(getGlobalContext(), "underflow", handler);
+  BasicBlock *otherBlock = BasicBlock::Create(getGlobalContext(), "otherFault", handler);
+
+  builder.SetInsertPoint(entry);
+  Value *addressSlot = builder.CreateBitCast(builder.CreateConstGEP1_32(info, offsetof(siginfo_t, si_addr)), 
+    PointerType::get(int8PointerTy, 0));
+  Value *address = builder.CreatePtrToInt(builder.CreateLoad(addressSlot), int64Ty, "address");
+  Value *base = builder.CreatePtrToInt(builder.CreateLoad(regionGlobal), int64Ty, "regionBase");
+  Value *offset = builder.CreateSub(address, base, "offset");  // huge if the address is below the region
+  builder.CreateCondBr(builder.CreateICmpULT(offset, getInt64(stackGuardSize)), overflowBlock, notOverflowBlock);  // the stack grows down
+
+  builder.SetInsertPoint(notOverflowBlock);
+  Value *inLowerGuard = builder.CreateICmpUGE(offset, getInt64(stackRegionSize - stackGuardSize));
+  Value *inRegion = builder.CreateICmpULT(offset, getInt64(stackRegionSize));
+  builder.CreateCondBr(builder.CreateAnd(inLowerGuard, inRegion), underflowBlock, otherBlock);
+
+  Type *writeParams[] = { int32Ty, int8PointerTy, int64Ty };
+  Constant *write_ = theModule -> getOrInsertFunction("write", FunctionType::get(int64Ty, writeParams, false));
+  Constant *exit_ = theModule -> getOrInsertFunction("_exit", FunctionType::get(voidTy, int32Ty, false));
+  BasicBlock *reportBlocks[] = { overflowBlock, underflowBlock };
+  std::string messages[] = { "Stack overflow\n", "Stack underflow\n" };
+  for (unsigned idx = 0; idx < 2; ++idx) {
+    builder.SetInsertPoint(reportBlocks[idx]);
+    builder.CreateCall3(write_, getInt32(2), builder.CreateGlobalStringPtr(messages[idx]), getInt64(messages[idx].size()));
+    builder.CreateCall(exit_, getInt32(1));
+    builder.CreateUnreachable();
+  }
+
+  builder.SetInsertPoint(otherBlock);
+  Type *signalParams[] = { int32Ty, int8PointerTy };
+  Constant *signal_ = theModule -> getOrInsertFunction("signal", FunctionType::get(int8PointerTy, signalParams, false));
+  builder.CreateCall2(signal_, sig, Constant::getNullValue(int8PointerTy));  // SIG_DFL, then the fault happens again
+  builder.CreateRetVoid();
+
+  // The handler is installed with sigaction, since it needs the fault address. The struct sigaction
+  // is laid out by this machine's headers, then the handler is filled in when the program starts.
+  builder.SetInsertPoint(mainBlock);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_SIGINFO;
+  Constant *actionBytes = ConstantDataArray::get(getGlobalContext(), ArrayRef<uint8_t>((uint8_t *)&action, sizeof(action)));
+  GlobalVariable *actionGlobal = new GlobalVariable(*theModule, actionBytes -> getType(), false, GlobalValue::PrivateLinkage, 
+    actionBytes, "stackFaultAction");
+  Value *actionPointer = builder.CreateConstInBoundsGEP2_32(actionGlobal, 0, 0);
+  Value *handlerSlot = builder.CreateBitCast(builder.CreateConstGEP1_32(actionPointer, offsetof(struct sigaction, sa_sigaction)), 
+    PointerType::get(PointerType::get(handlerType, 0), 0));
+  builder.CreateStore(handler, handlerSlot);
+
+  Type *sigactionParams[] = { int32Ty, int8PointerTy, int8PointerTy };
+  Constant *sigaction_ = theModule -> getOrInsertFunction("sigaction", FunctionType::get(int32Ty, sigactionParams, false));
+  builder.CreateCall3(sigaction_, getInt32(SIGSEGV), actionPointer, Constant::getNullValue(int8PointerTy));
+  builder.CreateCall3(sigaction_, getInt32(SIGBUS), actionPointer, Constant::getNullValue(int8PointerTy));
+
+}
+
+
+////////////////////
+// Top level loops
+////////////////////
+
+// The REPL does all its LLVM work on a separate compiler thread, so that reading, parsing and 
+// interpreting input never waits on code generation. Anything that touches LLVM goes through 
+// queueCompilerJob. Without a compiler thread (e.g. when embedded), jobs just run immediately.
+// When input arrives faster than it can be compiled (say, a big library piped in), the front end
+// waits once maxBackgroundJobs jobs are queued, so the queue and the words it holds stay bounded.
+
+static const unsigned maxBackgroundJobs = 256;
+
+static std::thread compilerThread;
+static std::deque<std::function<void()> > compilerJobs;
+static std::mutex compilerMutex;
+static std::condition_variable compilerWakeUp;
+static std::condition_variable compilerRoom;  // signalled when a non-urgent job is taken off the queue
+static unsigned backgroundJobs = 0;  // non-urgent jobs waiting in compilerJobs
+static bool compilerStopping = false;
+
+static void compilerLoop() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(compilerMutex);
+      while (compilerJobs.empty() && !compilerStopping) compilerWakeUp.wait(lock);
+      if (compilerJobs.empty()) return;  // stopping, and nothing left to do
+      job = compilerJobs.front();
+      compilerJobs.pop_front();
+    }
+    job();
+  }
+}
+
+void startCompilerThread() {
+  llvm_start_multithreaded();
+  compilerStopping = false;
+  compilerThread = std::thread(compilerLoop);
+}
+
+void stopCompilerThread() {
+  // Finish any queued jobs, then stop
+  if (!compilerThread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(compilerMutex);
+    compilerStopping = true;
+  }
+  compilerWakeUp.notify_one();
+  compilerThread.join();
+}
+
+std::future<void> queueCompilerJob(std::function<void()> job, bool urgent) {
+  // Run job on the compiler thread. Urgent jobs go ahead of everything else in the queue. 
+  // The returned future is ready once the job is done.
+
+  // Non-urgent jobs wait behind maxBackgroundJobs others, except on the compiler thread itself 
+  // (retiring a word queues jobs to release the words it calls), which would wait forever.
+
+  std::shared_ptr<std::promise<void> > done(new std::promise<void>);
+  std::future<void> finished = done -> get_future();
+  std::function<void()> task = [job, done]() { job(); done -> set_value(); };
+
+  if (!compilerThread.joinable()) {
+    task();
+    return finished;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(compilerMutex);
+    if (urgent) {
+      compilerJobs.push_front(task);
+    } else {
+      if (std::this_thread::get_id() != compilerThread.get_id()) {
+        while (backgroundJobs >= maxBackgroundJobs) compilerRoom.wait(lock);
+      }
+      ++backgroundJobs;
+      compilerJobs.push_back([task]() {
+        {
+          std::lock_guard<std::mutex> lock(compilerMutex);
+          --backgroundJobs;
+        }
+        compilerRoom.notify_all();
+        task();
+      });
+    }
+  }
+  compilerWakeUp.notify_one();
+
+  return finished;
+}
+
+static void compileNative(Word *word) {
+  // Generate code for word and JIT compile it. Only for use in compiler jobs, and only ones queued
+  // while something still used word - it can't be retired before they run. Words that have been 
+  // replaced since are left alone, since their retire job is on its way.
+  if (word -> native || word -> users == 0) return;
+  word -> native = (void (*)())TheExecutionEngine -> getPointerToFunction(compileWord(word));
+}
+
+static void addFunctionPasses(FunctionPassManager &fpm);
+
+static bool isBuiltInFunction(Function *f) {
+  if (!f) return false;
+  if (f == push || f == pop) return true;
+  for (unsigned idx = 0; idx < sizeof(builtIns) / sizeof(builtIns[0]); ++idx) {
+    if (f -> getName() == builtIns[idx].function) return true;
+  }
+  return false;
+}
+
+static bool inlineBuiltInCall(Function *f) {
+  // Inline one call to a built-in (or push or pop) in f. Returns false if there weren't any left.
+
+  for (Function::iterator block = f -> begin(); block != f -> end(); ++block) {
+    for (BasicBlock::iterator inst = block -> begin(); inst != block -> end(); ++inst) {
+      CallInst *call = dyn_cast<CallInst>(&*inst);
+      if (!call || !isBuiltInFunction(call -> getCalledFunction())) continue;
+      if (call -> getCalledFunction() -> Materialize()) continue;  // still in the embedded runtime's bitcode
+      InlineFunctionInfo info;
+      if (InlineFunction(call, info)) return true;  // the iterators are no good after this
+    }
+  }
+  return false;
+
+}
+
+void optimizeForJIT(Word *word) {
+  // Optimize word's functions before they're JIT compiled. Stack operations are calls to push, pop
+  // and the built-ins, so those are inlined first, leaving loads and stores that the function 
+  // passes can clean up. Only for use in compiler jobs.
+
+  static FunctionPassManager *passes = 0;
+  if (!passes) {
+    passes = new FunctionPassManager(theModule);
+    addFunctionPasses(*passes);
+    passes -> doInitialization();
+  }
+
+  Function *functions[] = { word -> function, word -> registerFunction };
+  for (unsigned idx = 0; idx < 2; ++idx) {
+    if (!functions[idx]) continue;
+    while (inlineBuiltInCall(functions[idx])) {}
+    passes -> run(*functions[idx]);
+  }
+
+}
+
+static void retireWord(Word *word) {
+  // Free a word that nothing can call any more - its machine code, IR, AST and threaded code. 
+  // Only for use in compiler jobs. Words it calls are released in turn, so their callers' IR is
+  // always erased before theirs.
+
+  if (word -> function) {
+    TheExecutionEngine -> freeMachineCodeForFunction(word -> function);
+    word -> function -> eraseFromParent();
+  }
+  if (word -> registerFunction) {  // erased after function, which calls it
+    TheExecutionEngine -> freeMachineCodeForFunction(word -> registerFunction);
+    word -> registerFunction -> eraseFromParent();
+  }
+  if (word -> memoCache) {  // nothing else can use these once the word is retired
+    TheExecutionEngine -> updateGlobalMapping(word -> memoCache, 0);
+    TheExecutionEngine -> updateGlobalMapping(word -> memoStats, 0);
+    word -> memoCache -> eraseFromParent();
+    word -> memoStats -> eraseFromParent();
+    free(word -> memoMemory);
+  }
+  delete word -> definition;
+  delete word;
+}
+
+void releaseWord(Word *word) {
+  // Built-ins stay around for good. So does everything when we're not JITing, since the whole 
+  // module ends up in the output.
+  if (--word -> users == 0 && word -> definition != 0 && TheExecutionEngine) {
+    queueCompilerJob([word]() { retireWord(word); }, false);
+  }
+}
+
+// In the REPL, words start out running in a threaded code interpreter, which can begin executing them
+// right away. Definitions are compiled in the background as they're entered, and a word that gets hot 
+// before its turn comes is moved to the front of the queue. Once a word's machine code is ready, it's
+// used instead.
+
+static const unsigned hotThreshold = 100;
+
+static void (*pushNative)(double);  // the JIT compiled push and pop, so the interpreter shares the stack
+static double (*popNative)();
+
+std::vector<double> localsStack;  // locals of the words being interpreted
+
+void runWord(Word *word);
+
+static void interpret(Word *word) {
+  // Run word's threaded code. Each op jumps directly to the code for the next one (needs the GCC/Clang
+  // "labels as values" extension)
+
+  static void *handlers[] = { &&opPush, &&opCall, &&opLocals, &&opLocal, &&opBranchIfFalse, &&opBranch, &&opRecurse, &&opImage, &&opMemoStats, &&opReturn };
+  #define DISPATCH() goto *handlers[ip -> op]
+
+  ThreadedOp *code = &word -> code[0];
+  ThreadedOp *ip = code;
+  size_t frame = localsStack.size();  // where this call's locals start
+  double val;
+
+  DISPATCH();
+
+opPush:
+  pushNative(ip -> number);
+  ++ip;
+  DISPATCH();
+
+opCall:
+  runWord(ip -> word);
+  ++ip;
+  DISPATCH();
+
+opLocals:
+  localsStack.resize(frame + ip -> index);
+  for (unsigned idx = ip -> index; idx > 0; --idx) localsStack[frame + idx - 1] = popNative();  // rightmost first
+  ++ip;
+  DISPATCH();
+
+opLocal:
+  pushNative(localsStack[frame + ip -> index]);
+  ++ip;
+  DISPATCH();
+
+opBranchIfFalse:
+  val = popNative();
+  if (val < 0.0 || val > 0.0) ++ip;  // same test as the fcmp one in compiled code - NaN counts as false
+  else ip = code + ip -> index;
+  DISPATCH();
+
+opBranch:
+  ip = code + ip -> index;
+  DISPATCH();
+
+opRecurse:
+  runWord(word);
+  ++ip;
+  DISPATCH();
+
+opImage:
+  ip -> image -> run();
+  ++ip;
+  DISPATCH();
+
+opMemoStats:
+  ip -> stats -> run();
+  ++ip;
+  DISPATCH();
+
+opReturn:
+  localsStack.resize(frame);
+
+  #undef DISPATCH
+}
+
+void runWord(Word *word) {
+  // Run a word - with its machine code if it has some, otherwise with the interpreter.
+  // Built-ins can't be interpreted, so they're compiled (and waited for) the first time they're used.
+
+  void (*native)() = word -> native;
+
+  if (!native) {
+    if (word -> definition == 0 && word -> function != 0) {
+      queueCompilerJob([word]() { compileNative(word); }, true).wait();
+    } else if (word -> definition != 0 && ++word -> calls == hotThreshold) {
+      queueCompilerJob([word]() { compileNative(word); }, true);  // keep interpreting until it's ready
+    }
+    native = word -> native;
+  }
+
+  if (native) native();
+  else interpret(word);
+
+}
+
+void interpretASTNode(WordAST *node) {  // run a single top level word
+  
+  Word topLevel("");  // anonymous word to hold the code
+  unsigned loopDepth = beginOps.size();
+
+  node -> threadCode(topLevel.code);
+  emitOp(topLevel.code, OP_RETURN);
+
+  if (beginOps.size() != loopDepth) {  // a loop can't continue into the next top level word
+    beginOps.pop();
+    exitOps.pop();
+    throw CompilerException("begin can only be used inside a definition here");
+  }
+
+  if (int fault = sigsetjmp(stackFaultJump, 1)) {
+    // We don't know what state the stack was left in, so start again with an empty one
+    *stackTopNative = stackBottomNative;
+    localsStack.clear();
+    throw CompilerException(fault == 1 ? "Stack overflow" : "Stack underflow");
+  }
+
+  catchingStackFaults = 1;
+  try {
+    runWord(&topLevel);
+  } catch (CompilerException e) {
+    catchingStackFaults = 0;
+    throw;
+  }
+  catchingStackFaults = 0;
+
+  if (DefinitionAST *definition = dynamic_cast<DefinitionAST *>(node)) {
+    if (compilerThread.joinable()) {  // compile new definitions in the background, in order
+      Word *word = definition -> getWord();
+      queueCompilerJob([word]() { compileNative(word); }, false);
+    }
+  }
+
+}
+
+// When compiling a file, top-level code goes into a series of chunk functions, each holding about 
+// chunkSize words, which main calls in turn. Generated programs can have huge amounts of top-level 
+// code, and optimizing it as one enormous function would take much longer than in pieces.
+
+static unsigned chunkSize = 1000;  // 0 puts all top-level code in one chunk (for comparison)
+
+static BasicBlock *mainBlock;  // where main calls the chunks
+static std::vector<Function *> chunks;
+static unsigned chunkWords = 0;  // top-level words in the current chunk
+
+static void startChunk() {
+  // End the current chunk (if any) and point builder at a new one
+
+  if (!chunks.empty()) builder.CreateRetVoid();
+
+  Function *chunk = buildFunction("main.chunk");
+  chunks.push_back(chunk);
+  chunkWords = 0;
+
+  builder.SetInsertPoint(mainBlock);
+  builder.CreateCall(chunk);
+  builder.SetInsertPoint(&chunk -> getEntryBlock());
+
+}
+
+void finishChunks() {
+  // End the last chunk and main
+
+  builder.CreateRetVoid();
+  builder.SetInsertPoint(mainBlock);
+  builder.CreateRet(getInt32(0));
+
+  // Inlining would just put everything back into main
+  if (chunks.size() > 1) {
+    for (unsigned idx = 0; idx < chunks.size(); ++idx) chunks[idx] -> addFnAttr(Attribute::NoInline);
+  }
+
+}
+
+int mainLoop(bool JITMode) {
+
+  while (true) {
+    if (JITMode) showPrompt = true;  // ick
+    getNextToken();
+    showPrompt = false;  // ick
+    
+    WordAST *nextASTNode = 0;
+    try {
+      nextASTNode = parseToken(curTok);
+      if (nextASTNode == 0) return 0;  // EOF
+      if (JITMode) {
+        interpretASTNode(nextASTNode);
+        if (!dynamic_cast<DefinitionAST *>(nextASTNode)) delete nextASTNode;  // definitions belong to their word
+      } else {
+        nextASTNode -> codeGen();
+        // A loop can't be split between chunks
+        if (!dynamic_cast<DefinitionAST *>(nextASTNode) && chunkSize != 0 && ++chunkWords >= chunkSize && beginBlocks.empty()) startChunk();
+      }
+    } catch (CompilerException e) {  // TODO: Use more meaningful types than std::string or char const
+      std::cout << e.what() << "\n";
+      // The node holds references to the words it uses, which could never be retired otherwise
+      if (JITMode && !dynamic_cast<DefinitionAST *>(nextASTNode)) delete nextASTNode;
+      if (!JITMode) {
+        // If we're compiling a file, we want to stop here because we ran into an error
+        return 1;  
+      }
+    }
+  }
+
+}
+
+void optimizeProgram() {
+  // Optimize a whole compiled program, once optimizeFunctions has cleaned up each function. main 
+  // is the only way in, so everything else can be made internal - then words nothing uses are 
+  // dropped, and the rest can be inlined into each other and have their calling conventions and 
+  // globals simplified. The function passes at the end tidy up the code that inlining produces.
+
+  const char *roots[] = { "main" };
+
+  PassManager pm;
+  pm.add(createInternalizePass(roots));
+  pm.add(createGlobalDCEPass());
+  pm.add(createIPSCCPPass());
+  pm.add(createGlobalOptimizerPass());
+  pm.add(createDeadArgEliminationPass());
+  pm.add(createFunctionAttrsPass());
+  pm.add(createFunctionInliningPass());
+  pm.add(createArgumentPromotionPass());
+  pm.add(createScalarReplAggregatesPass());
+  pm.add(createInstructionCombiningPass());
+  pm.add(createGVNPass());
+  pm.add(createCFGSimplificationPass());
+  pm.add(createGlobalOptimizerPass());
+  pm.add(createGlobalDCEPass());
+  pm.run(*theModule);
+
+}
 
-    // Create a return for main function
-    builder.CreateRet(getInt32(0));
+// Before whole program optimization, a compiled file's functions are cleaned up one at a time, 
+// which is where most of the work is. Big programs spread that over several threads. An LLVMContext
+// can only be used by one thread at a time, so each thread reads the program from bitcode into a
+// context of its own. The bitcode is read lazily, so a thread only parses the bodies of the 
+// functions it optimizes. Those are linked back into theModule afterwards.
+
+static const unsigned minParallelFunctions = 64;  // fewer aren't worth copying the program around for
+
+static void addFunctionPasses(FunctionPassManager &fpm) {
+  fpm.add(createPromoteMemoryToRegisterPass());  // locals live in allocas
+  fpm.add(createInstructionCombiningPass());
+  fpm.add(createGVNPass());
+  fpm.add(createCFGSimplificationPass());
+}
+
+static void optimizePart(const std::string &program, const std::vector<std::string> &names, std::string &result, std::string &error) {
+  // Optimize the functions in names, writing them to result as bitcode. Runs on its own thread.
+  // Leaves result empty and sets error if something goes wrong.
+
+  LLVMContext partContext;
+  MemoryBuffer *buffer = MemoryBuffer::getMemBuffer(program, "program", false);
+  Module *part = getLazyBitcodeModule(buffer, partContext, &error);  // owns buffer if it succeeds
+  if (!part) {
+    delete buffer;
+    if (error.empty()) error = "couldn't read the program's bitcode";
+    return;
+  }
+
+  // Everything else is only declared, so it comes from the other parts when they're linked. The 
+  // other functions' bodies are never read, so they already look like declarations.
+  std::set<std::string> ours(names.begin(), names.end());
+  for (Module::iterator f = part -> begin(); f != part -> end(); ++f) {
+    if (f -> isMaterializable() && ours.count(f -> getName()) == 0) f -> deleteBody();  // just makes it external
+  }
+  for (Module::global_iterator g = part -> global_begin(); g != part -> global_end(); ++g) {
+    if (!g -> isDeclaration() && !g -> hasLocalLinkage()) g -> setInitializer(0);
+  }
+
+  {
+    FunctionPassManager fpm(part);
+    addFunctionPasses(fpm);
+
+    fpm.doInitialization();
+    for (unsigned idx = 0; idx < names.size(); ++idx) {
+      Function *f = part -> getFunction(names[idx]);
+      if (f -> Materialize(&error)) {
+        error = "couldn't read " + names[idx] + (error.empty() ? "" : ": " + error);
+        delete part;
+        return;
+      }
+      fpm.run(*f);
+    }
+    fpm.doFinalization();
+  }
+
+  raw_string_ostream out(result);
+  WriteBitcodeToFile(part, out);
+  out.flush();
+  delete part;
+
+}
+
+bool optimizeFunctions(unsigned jobs) {
+  // Optimize theModule's functions, on jobs threads if there are enough functions to be worth it.
+  // Returns false if something went wrong.
+
+  std::vector<Function *> functions;
+  for (Module::iterator f = theModule -> begin(); f != theModule -> end(); ++f) {
+    if (!f -> isDeclaration()) functions.push_back(&*f);
+  }
+
+  if (jobs < 2 || functions.size() < minParallelFunctions) {
+    FunctionPassManager fpm(theModule);
+    addFunctionPasses(fpm);
+    fpm.doInitialization();
+    for (unsigned idx = 0; idx < functions.size(); ++idx) fpm.run(*functions[idx]);
+    fpm.doFinalization();
+    return true;
+  }
+
+  std::vector<std::vector<std::string> > parts(jobs);
+  for (unsigned idx = 0; idx < functions.size(); ++idx) parts[idx % jobs].push_back(functions[idx] -> getName());
+
+  std::string program;
+  raw_string_ostream out(program);
+  WriteBitcodeToFile(theModule, out);
+  out.flush();
+
+  llvm_start_multithreaded();
+  std::vector<std::string> results(jobs);
+  std::vector<std::string> errors(jobs);
+  std::vector<std::thread> threads;
+  for (unsigned idx = 0; idx < jobs; ++idx) {
+    threads.push_back(std::thread(optimizePart, std::cref(program), std::cref(parts[idx]), std::ref(results[idx]), std::ref(errors[idx])));
+  }
+  for (unsigned idx = 0; idx < jobs; ++idx) threads[idx].join();
+
+  for (unsigned idx = 0; idx < jobs; ++idx) {
+    if (results[idx].empty()) {
+      std::cout << "Couldn't optimize code: " << errors[idx] << "\n";
+      return false;
+    }
+  }
+
+  // Swap the old bodies for the optimized ones
+  for (unsigned idx = 0; idx < functions.size(); ++idx) functions[idx] -> deleteBody();
+  for (unsigned idx = 0; idx < jobs; ++idx) {
+    std::unique_ptr<MemoryBuffer> buffer(MemoryBuffer::getMemBuffer(results[idx], "part", false));
+    std::string error;
+    Module *part = ParseBitcodeFile(buffer.get(), getGlobalContext(), &error);
+    if (!part || Linker::LinkModules(theModule, part, Linker::DestroySource, &error)) {
+      std::cout << "Couldn't link optimized code: " << error << "\n";
+      return false;
+    }
+    delete part;
+  }
+
+  return true;
+
+}
+
+
+////////////////////
+// Saved images
+////////////////////
+
+// An image holds everything needed to pick up where a REPL session left off: the contents of the
+// stack, the dictionary (word names and the functions that implement them), and the module with
+// every word's code as bitcode. All numbers are stored in the machine's own byte order.
+
+static const char imageMagic[8] = { 'R', 'P', 'N', 'I', 'M', 'G', '2', '\n' };
+
+std::string programPath;  // how we were started, so that load-image can start over
+std::vector<double> imageStack;  // stack contents from a loaded image, top first
+
+std::vector<double> stackContents() {
+  // Returns the values on the stack, top first
+
+  return std::vector<double>(*stackTopNative, stackBottomNative);
+}
+
+static void writeInteger(std::ostream &out, uint64_t x) {
+  out.write((const char *)&x, sizeof(x));
+}
+
+static void writeString(std::ostream &out, std::string str) {
+  writeInteger(out, str.size());
+  out.write(str.data(), str.size());
+}
+
+static uint64_t readInteger(const char *&p, const char *end) {
+  uint64_t x;
+  if ((size_t)(end - p) < sizeof(x)) throw CompilerException("image is truncated");
+  memcpy(&x, p, sizeof(x));
+  p += sizeof(x);
+  return x;
+}
+
+static std::string readString(const char *&p, const char *end) {
+  uint64_t length = readInteger(p, end);
+  if ((uint64_t)(end - p) < length) throw CompilerException("image is truncated");
+  p += length;
+  return std::string(p - length, length);
+}
+
+void saveImage(std::string filename) {
+  // Write the current session to filename. Only for use in compiler jobs.
+
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  if (!out.is_open()) throw CompilerException("Couldn't open file \"" + filename + "\"");
+
+  // ASTs aren't saved, so every word needs to have code
+  for (std::map<std::string, Word *>::iterator i = words.begin(); i != words.end(); ++i) compileWord(i -> second);
+
+  out.write(imageMagic, sizeof(imageMagic));
+
+  std::vector<double> stack = stackContents();
+  writeInteger(out, stack.size());
+  out.write((const char *)stack.data(), stack.size() * sizeof(double));
+
+  writeInteger(out, words.size());
+  for (std::map<std::string, Word *>::iterator i = words.begin(); i != words.end(); ++i) {
+    writeString(out, i -> first);
+    writeString(out, i -> second -> function -> getName());
+  }
+
+  theModule -> MaterializeAll();  // make sure no built-ins are left in the embedded runtime
+  std::string bitcode;
+  raw_string_ostream bitcodeStream(bitcode);
+  WriteBitcodeToFile(theModule, bitcodeStream);
+  bitcodeStream.flush();
+
+  writeInteger(out, bitcode.size());
+  while (out.tellp() % 8 != 0) out.put(0);  // keep the bitcode aligned when the file is mapped
+  out.write(bitcode.data(), bitcode.size());
+
+  if (!out) throw CompilerException("Couldn't write image \"" + filename + "\"");
+
+}
+
+void loadImage(std::string filename) {
+  // Start from an image instead of generating the built-ins. The file is memory mapped, and as 
+  // with the embedded runtime, functions are only read from the bitcode when they're needed.
+
+  OwningPtr<MemoryBuffer> file;
+  if (error_code err = MemoryBuffer::getFile(filename, file, -1, false)) {
+    fprintf(stderr, "Couldn't open image \"%s\": %s\n", filename.c_str(), err.message().c_str());
+    exit(1);
+  }
+
+  try {
+    const char *start = file -> getBufferStart();
+    const char *end = file -> getBufferEnd();
+    const char *p = start;
+
+    if ((size_t)(end - p) < sizeof(imageMagic) || memcmp(p, imageMagic, sizeof(imageMagic)) != 0) {
+      throw CompilerException("not an RPN image");
+    }
+    p += sizeof(imageMagic);
+
+    uint64_t depth = readInteger(p, end);
+    if ((uint64_t)(end - p) / sizeof(double) < depth) throw CompilerException("image is truncated");
+    imageStack.resize(depth);
+    memcpy(imageStack.data(), p, depth * sizeof(double));
+    p += depth * sizeof(double);
+
+    uint64_t wordCount = readInteger(p, end);
+    std::vector<std::pair<std::string, std::string> > dictionary;
+    for (uint64_t idx = 0; idx < wordCount; ++idx) {
+      std::string name = readString(p, end);
+      dictionary.push_back(std::make_pair(name, readString(p, end)));
+    }
+
+    uint64_t bitcodeSize = readInteger(p, end);
+    p = start + ((p - start + 7) / 8) * 8;
+    if (p > end || (uint64_t)(end - p) < bitcodeSize) throw CompilerException("image is truncated");
+
+    MemoryBuffer *bitcode = MemoryBuffer::getMemBuffer(StringRef(p, bitcodeSize), filename, false);
+    std::string error;
+    Module *image = getLazyBitcodeModule(bitcode, getGlobalContext(), &error);
+    if (!image) throw CompilerException(error);
+    useRuntimeModule(image);
+
+    // Saved words come back without ASTs, so they're run like built-ins
+    for (unsigned idx = 0; idx < dictionary.size(); ++idx) {
+      Word *word = new Word(dictionary[idx].first);
+      word -> function = theModule -> getFunction(dictionary[idx].second);
+      if (!word -> function) throw CompilerException("image is missing code for \"" + word -> name + "\"");
+      useBuiltInEffect(word);  // saved definitions are treated as dynamic and impure
+      ++word -> users;
+      words[word -> name] = word;
+    }
+  } catch (CompilerException e) {
+    fprintf(stderr, "Couldn't load image \"%s\": %s\n", filename.c_str(), e.what());
+    exit(1);
+  }
+
+  file.take();  // the module reads its bitcode straight from the mapped file, so keep it around
+
+}
+
+void restartWithImage(std::string filename) {
+  // A running JIT can't swap out its whole module, so load-image starts rpn over on the image instead
+
+  if (programPath == "") throw CompilerException("images can only be loaded in the REPL");
+
+  // Starting over throws away whatever we've read but not run yet
+  if (inputLeftOver()) throw CompilerException("load-image has to come last on a line typed at the terminal");
+
+  stopCompilerThread();
+  std::cout.flush();
+  fflush(stdout);
+
+  const char *args[] = { programPath.c_str(), "--image", filename.c_str(), 0 };
+  execvp(programPath.c_str(), (char * const *)args);
+
+  startCompilerThread();  // we only get here if rpn couldn't be started again
+  throw CompilerException("Couldn't restart rpn with image \"" + filename + "\"");
+
+}
+
+void ImageAST::run() {
+
+  if (!saving) {
+    restartWithImage(filename);  // doesn't return unless it fails
+    return;
+  }
+
+  std::string name = filename;
+  std::string error;
+  queueCompilerJob([name, &error]() {
+    try {
+      saveImage(name);
+    } catch (CompilerException e) {
+      error = e.what();
+    }
+  }, true).wait();
+
+  if (error != "") throw CompilerException(error);
+
+}
+
+void initCompiler(bool JITMode, std::string image = "") {
+  // Set up the module, the stack and the built-in words, plus an execution engine if we're JITing.
+  // If an image file is given, everything comes from there instead.
+
+  InitializeNativeTarget(); 
+
+  if (image != "") {
+    loadImage(image);
+  } else {
+#ifdef RPN_EMBEDDED_RUNTIME
+    loadRuntime();
+#else
+    buildRuntime();
+#endif
+    registerBuiltIns();
+  }
+
+  if (JITMode) {
+    // if we're JITing, we need to set up an execution engine
+    
+    std::string ErrStr;
+    TheExecutionEngine = EngineBuilder(theModule).setErrorStr(&ErrStr).create();
+    
+    if (!TheExecutionEngine) {
+      fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
+      exit(1);
+    }
+
+    // Compile everything a function needs up front, since lazy compilation would happen on whichever
+    // thread first calls the function
+    TheExecutionEngine -> DisableLazyCompilation(true);
+
+    setUpStack();
+    pushNative = (void (*)(double))TheExecutionEngine -> getPointerToFunction(push);
+    popNative = (double (*)())TheExecutionEngine -> getPointerToFunction(pop);
+
+    for (size_t idx = imageStack.size(); idx > 0; --idx) pushNative(imageStack[idx - 1]);  // bottom first
+  }
+
+}
+
+
+////////////////////
+// Embedding interface
+////////////////////
+
+Program::Program(std::map<std::string, Word *> Words) : words(Words) {
+  for (std::map<std::string, Word *>::iterator i = words.begin(); i != words.end(); ++i) ++i -> second -> users;
+}
+
+NativeWord Program::getWord(std::string name) {
+
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);  // words are case insensitive
+
+  if (natives.count(name) == 1) return natives[name];
+  if (words.count(name) == 0) throw CompilerException("Unknown word \"" + name + "\"");
+
+  Function *wrapper = buildNativeWrapper(compileWord(words[name]));
+  return natives[name] = (NativeWord)TheExecutionEngine -> getPointerToFunction(wrapper);
+
+}
+
+Program *Compiler::compile(std::string source) {
+
+  static bool initialized = false;
+  if (!initialized) {
+    initCompiler(true);
+    initialized = true;
+  }
+
+  std::istringstream stream(source);
+  setInput(&stream);
+
+  WordAST *nextASTNode = 0;
+  try {
+    while (true) {
+      nextASTNode = 0;  // so a parse error doesn't delete the previous node again
+      nextASTNode = parseToken(getNextToken());
+      if (nextASTNode == 0) break;  // EOF
+      interpretASTNode(nextASTNode);
+      if (!dynamic_cast<DefinitionAST *>(nextASTNode)) delete nextASTNode;
+    }
+  } catch (CompilerException e) {
+    if (!dynamic_cast<DefinitionAST *>(nextASTNode)) delete nextASTNode;  // releases the words it uses
+    *stackTopNative = stackBottomNative;
+    throw;
+  }
+
+  // Whatever the source left on the stack would otherwise come back from the first NativeWord call
+  *stackTopNative = stackBottomNative;
+
+  return new Program(words);
+
+}
+
+void Compiler::catchStackFaults() {
+  ::catchStackFaults();
+}
+
+size_t Compiler::call(NativeWord word, const double *in, size_t nIn, double *out, size_t maxOut) {
+
+  if (int fault = sigsetjmp(stackFaultJump, 1)) {
+    *stackTopNative = stackBottomNative;  // as in interpretASTNode
+    throw CompilerException(fault == 1 ? "Stack overflow" : "Stack underflow");
+  }
+
+  catchingStackFaults = 1;
+  size_t count = word(in, nIn, out, maxOut);
+  catchingStackFaults = 0;
+  return count;
+
+}
+
+
+#ifndef RPN_LIBRARY
+
+////////////////////
+// Batch evaluation
+////////////////////
+
+static const size_t mapBufferSize = 1 << 20;  // how much input we read (and output we hold) at once
+static const size_t mapMaxResults = 256;  // results beyond this many per record are dropped
+
+static size_t splitTextRecords(char *buf, size_t length, std::vector<double> &fields, std::vector<size_t> &rowEnds, unsigned long long &lines) {
+  // Parse every complete line in buf into fields, recording where each non-blank line's fields end.
+  // Returns the number of bytes consumed - anything after the last newline is left for the next call.
+  // lines counts the lines read so far. A line that isn't numbers throws, leaving fields and rowEnds
+  // holding the lines before it.
+
+  char *p = buf;
+  char *end = buf + length;
+
+  while (char *newline = (char *)memchr(p, '\n', end - p)) {
+    size_t fieldCount = fields.size();
+    while (p < newline) {
+      if (*p == ',' || isspace(*p)) {
+        p++;
+        continue;
+      }
+      char *numberEnd;
+      fields.push_back(strtod(p, &numberEnd));
+      if (numberEnd == p) {
+        fields.resize(fieldCount);
+        throw std::runtime_error("Couldn't read a number from \"" + std::string(p, newline) + "\" on line " + std::to_string(lines + 1));
+      }
+      p = numberEnd;
+    }
+    if (fields.size() > fieldCount) rowEnds.push_back(fields.size());
+    p = newline + 1;
+    lines++;
+  }
+
+  return p - buf;
+}
+
+static size_t splitBinaryRecords(char *buf, size_t length, unsigned fieldsPerRecord, std::vector<double> &fields, std::vector<size_t> &rowEnds) {
+  // Same as splitTextRecords, but for records made of fieldsPerRecord raw doubles
+
+  size_t recordSize = fieldsPerRecord * sizeof(double);
+  size_t records = length / recordSize;
+
+  size_t fieldCount = fields.size();
+  fields.resize(fieldCount + records * fieldsPerRecord);
+  if (records > 0) memcpy(&fields[fieldCount], buf, records * recordSize);
+  for (size_t idx = 1; idx <= records; ++idx) rowEnds.push_back(fieldCount + idx * fieldsPerRecord);
+
+  return records * recordSize;
+}
+
+static void writeResults(std::string &out, double *results, size_t count, bool binary) {
+  // Append one record's results to out, bottom of the stack first
+
+  if (binary) {
+    for (size_t idx = count; idx > 0; --idx) out.append((char *)&results[idx - 1], sizeof(double));
+    return;
+  }
+
+  char number[64];
+  for (size_t idx = count; idx > 0; --idx) {
+    int length = snprintf(number, sizeof(number), "%f", results[idx - 1]);  // same format as "."
+    out.append(number, length);
+    if (idx > 1) out += ',';
+  }
+  out += '\n';
+}
+
+int mapLoop(std::string expression, unsigned binaryFields) {
+  // Compile expression once, then apply it to each record on stdin, writing its results to stdout.
+  // Records are lines of numbers separated by commas or whitespace, or if binaryFields isn't 0,
+  // groups of that many raw doubles. The fields of a record are pushed in order before evaluating.
+
+  NativeWord word;
+  try {
+    word = Compiler::compile(": map-expression " + expression + " ;") -> getWord("map-expression");
+  } catch (CompilerException e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+  catchStackFaults();
+
+  std::vector<char> in(mapBufferSize + 1);  // room for a newline after an unterminated last line
+  size_t pending = 0;  // bytes of an incomplete record left over from the previous read
+  bool eof = false;
+
+  std::vector<double> fields;
+  std::vector<size_t> rowEnds;
+  double results[mapMaxResults];
+  std::string out;
+  out.reserve(mapBufferSize + mapMaxResults * 64);
+
+  unsigned long long rows = 0;
+  unsigned long long lines = 0;  // lines of text input read
+  volatile unsigned long long row = 0;  // the record being evaluated, counting from 1 (see below)
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  while (!eof) {
+    size_t got = fread(&in[pending], 1, in.size() - 1 - pending, stdin);
+    size_t available = pending + got;
+    if (got == 0) {
+      eof = true;
+      if (!binaryFields && available > 0) in[available++] = '\n';
+    }
+
+    // Split everything we have into a batch of records, then run the whole batch
+    fields.clear();
+    rowEnds.clear();
+    size_t used = 0;
+    std::string badLine;  // set if the input stops making sense partway through the batch
+    try {
+      if (binaryFields) {
+        used = splitBinaryRecords(&in[0], available, binaryFields, fields, rowEnds);
+      } else {
+        used = splitTextRecords(&in[0], available, fields, rowEnds, lines);
+      }
+    } catch (std::runtime_error e) {
+      badLine = e.what();
+    }
+
+    // A record without enough fields underflows the stack. Since nothing can be said about the
+    // stack afterwards, that's the end of the run.
+    if (int fault = sigsetjmp(stackFaultJump, 1)) {
+      fwrite(out.data(), 1, out.size(), stdout);
+      fflush(stdout);
+      std::cerr << (fault == 1 ? "Stack overflow" : "Stack underflow") << " in record " << row << "\n";
+      return 1;
+    }
+
+    catchingStackFaults = 1;
+    size_t rowStart = 0;
+    for (unsigned idx = 0; idx < rowEnds.size(); ++idx) {
+      row = rows + idx + 1;
+      size_t count = word(&fields[rowStart], rowEnds[idx] - rowStart, results, mapMaxResults);
+      writeResults(out, results, count, binaryFields != 0);
+      if (out.size() >= mapBufferSize) {
+        fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+      }
+      rowStart = rowEnds[idx];
+    }
+    catchingStackFaults = 0;
+    rows += rowEnds.size();
+
+    // The records before a bad line still get their results
+    if (!badLine.empty()) {
+      fwrite(out.data(), 1, out.size(), stdout);
+      fflush(stdout);
+      std::cerr << badLine << "\n";
+      return 1;
+    }
+
+    // Keep any incomplete record for the next read, making room if one record fills the whole buffer
+    pending = available - used;
+    memmove(&in[0], &in[used], pending);
+    if (pending == in.size() - 1) in.resize(in.size() * 2);
+  }
+
+  fwrite(out.data(), 1, out.size(), stdout);
+  fflush(stdout);
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cerr << rows << " rows in " << seconds << " seconds (" << (seconds > 0 ? rows / seconds : 0) << " rows/second)\n";
+
+  if (pending > 0) {  // only possible with binary input, since a newline ends any text record
+    std::cerr << "Ignored " << pending << " bytes at the end of the input, which weren't a whole record\n";
+    return 1;
+  }
+
+  return 0;
+
+}
+
+int main(int argc, char *argv[]) {
+  
+  bool JITMode;
+  bool optimize = true;
+  unsigned jobs = std::max(std::thread::hardware_concurrency(), 1u);  // threads for optimizing a compiled file
+  std::string image;
+
+  std::ifstream fs;  // the filestream to open if we need one
+
+  if (argc >= 3 && std::string(argv[1]) == "--map") {  // batch mode: rpn --map expression [--binary fields]
+    unsigned binaryFields = 0;
+    if (argc == 5 && std::string(argv[3]) == "--binary") binaryFields = strtoul(argv[4], 0, 10);
+    if (argc != 3 && binaryFields == 0) {
+      std::cout << "usage: rpn --map expression [--binary fields]\n";
+      return 1;
+    }
+    return mapLoop(argv[2], binaryFields);
+  }
+
+  if (argc == 2 && std::string(argv[1]) == "--emit-runtime") {  // write the built-ins as bitcode to embed
+    InitializeNativeTarget();
+    buildRuntime();
+    optimizeRuntime();
+    raw_os_ostream out(std::cout);
+    WriteBitcodeToFile(theModule, out);
+    return 0;
+  }
+
+  if (argc >= 4 && std::string(argv[1]) == "-j") {  // compile a file with a given number of threads
+    jobs = std::max(strtoul(argv[2], 0, 10), 1ul);
+    argc -= 2;
+    argv += 2;
+  }
+
+  if (argc >= 4 && std::string(argv[1]) == "--chunk-size") {  // compile a file with a given chunk size
+    chunkSize = strtoul(argv[2], 0, 10);
+    argc -= 2;
+    argv += 2;
+  }
+
+  if (argc == 3 && std::string(argv[1]) == "-O0") {  // compile a file without whole program optimization
+    optimize = false;
+    argc--;
+    argv++;
+  }
+
+  if (argc == 1) {  // if no file, then we just read stdin in JITMode
+    JITMode = true;
+    setInput(&std::cin);
+  } else if (argc == 3 && std::string(argv[1]) == "--image") {  // REPL starting from a saved image
+    JITMode = true;
+    image = argv[2];
+    setInput(&std::cin);
+  } else if (argc == 2) {  // otherwise open the file we got on the command line
+    JITMode = false;
+    fs.open(argv[1]);
+    if (!fs.is_open()) {
+      std::cout << "Couldn't open file \"" << argv[1] << "\"\n";
+      return 1;
+    }
+    setInput(&fs);  // point inputStream to our file so other functions can use it
+  } else {
+    std::cout << "usage: rpn [-j jobs] [--chunk-size words] [-O0] [filename]\n       rpn --image image\n       rpn --map expression [--binary fields]\n       rpn --emit-runtime\n";
+    return 1;
+  }
+
+  initCompiler(JITMode, image);
+
+  if (JITMode) {
+    programPath = argv[0];
+
+    std::cout << "Welcome to rpn!\n";
+
+    catchStackFaults();
+    startCompilerThread();
+    mainLoop(JITMode);
+    stopCompilerThread();
+
+  } else {
+    // if we're not JITing, then we need to wrap our generated code in a main function
+    
+    FunctionType *mainType = FunctionType::get(int32Ty, false);
+    Function *mainFunction = Function::Create(mainType, Function::ExternalLinkage, "main", theModule);
+    mainBlock = BasicBlock::Create(getGlobalContext(), "entry", mainFunction);
+    builder.SetInsertPoint(mainBlock);
+    buildStackSetup();
+    startChunk();
+
+    if (mainLoop(JITMode) == 1) return 1;
+    
+    if (fs.is_open()) fs.close();
+
+    finishChunks();
+
+    theModule -> MaterializeAll();  // read in any built-ins still waiting in the embedded bitcode
+
+    if (optimize) {
+      if (!optimizeFunctions(jobs)) return 1;
+      optimizeProgram();
+    }
   }
 
   /*static FunctionPassManager *ThePM;
@@ -997,3 +3363,5 @@ int main(int argc, char *argv[]) {
 
   return 0;
 }
+
+#endif
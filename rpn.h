@@ -0,0 +1,54 @@
+
+/* Interface for embedding the RPN compiler in other programs.
+ * Compile rpn.cpp with -DRPN_LIBRARY to leave out the REPL's main function.
+ */
+
+#ifndef RPN_H
+#define RPN_H
+
+#include <cstddef>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+struct Word;
+
+class CompilerException: public std::runtime_error {
+  public:
+    CompilerException(std::string const& whatValue) : std::runtime_error(whatValue) {};
+};
+
+// A compiled word that can be called like any other C function. The nIn values in "in" are pushed
+// onto the stack first (so in[nIn - 1] ends up on top), then the word runs, then everything left on
+// the stack is popped. The first maxOut of those results go into "out", top of the stack first, and
+// the number written is returned. The stack is always left empty, so calls don't affect each other.
+// There is only one stack, though, so calls must not run at the same time on different threads,
+// and none can run during Compiler::compile.
+typedef size_t (*NativeWord)(const double *in, size_t nIn, double *out, size_t maxOut);
+
+class Program {
+  std::map<std::string, Word *> words;  // the dictionary as it stood right after compiling
+  std::map<std::string, NativeWord> natives;
+public:
+  Program(std::map<std::string, Word *> Words);  // keeps all of these words alive for good
+  NativeWord getWord(std::string name);  // throws CompilerException if name isn't defined
+};
+
+class Compiler {
+public:
+  // Compile and run source as if it were typed into the REPL. Throws CompilerException on errors.
+  // Either way, the stack is emptied before it returns.
+  static Program *compile(std::string source);
+
+  // Stack overflows and underflows hit a guard page, which raises SIGSEGV (or SIGBUS on some
+  // systems) and kills the program unless it handles them itself. Once this has been called,
+  // compile throws CompilerException for them instead, and so does call. It installs handlers for
+  // both signals, replacing any the program already had, so it's up to the program to opt in.
+  static void catchStackFaults();
+
+  // Call word, throwing CompilerException if it overflows or underflows the stack (after
+  // catchStackFaults). Calling a NativeWord directly is a little faster, but a fault is fatal.
+  static size_t call(NativeWord word, const double *in, size_t nIn, double *out, size_t maxOut);
+};
+
+#endif
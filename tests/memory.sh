@@ -0,0 +1,49 @@
+#!/bin/sh
+# Check that a long REPL session doesn't keep growing. Pipes a million lines of redefinitions and
+# top-level code into the REPL, sampling its resident set size (VmRSS, Linux only) as it goes, and
+# fails if the last quarter of the run used noticeably more memory than the first quarter.
+#
+#   tests/memory.sh [path to rpn] [lines]
+
+rpn=${1:-./rpn}
+lines=${2:-1000000}
+
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+
+# Every definition replaces the last one of the same name, so the dictionary never grows. The memo
+# word gets a fresh cache with every definition.
+awk -v lines="$lines" 'BEGIN {
+  for (i = 0; i < lines; i += 4) {
+    print ": square dup * ;"
+    print ": next memo dup " i % 100 " + ;"
+    print i % 1000 " square next + drop"
+    print "1 2 + 3 * " i % 7 " - drop"
+  }
+}' > "$input"
+
+# The REPL only reads ahead of its compiler thread by a bounded number of definitions, so this
+# takes about as long as compiling all of them.
+start=$(date +%s)
+"$rpn" < "$input" > /dev/null &
+pid=$!
+
+samples=""
+while kill -0 "$pid" 2> /dev/null; do
+  rss=$(awk '/^VmRSS/ { print $2 }' "/proc/$pid/status" 2> /dev/null)
+  [ -n "$rss" ] && samples="$samples $rss"
+  sleep 0.5
+done
+wait "$pid" || { echo "rpn failed"; exit 1; }
+
+echo "$lines lines in $(($(date +%s) - start)) seconds"
+echo "VmRSS samples (kB):$samples"
+echo "$samples" | awk '{
+  if (NF < 8) { print "too few samples - try more lines"; exit 1 }
+  quarter = int(NF / 4)
+  for (i = 1; i <= quarter; i++) if ($i > early) early = $i
+  for (i = NF - quarter + 1; i <= NF; i++) if ($i > late) late = $i
+  printf "largest in first quarter: %d kB, in last quarter: %d kB\n", early, late
+  if (late > early * 1.2) { print "FAIL: memory kept growing"; exit 1 }
+  print "OK"
+}'